@@ -15,8 +15,34 @@ public:
     vec3 min() const { return _min; }
     vec3 max() const { return _max; }
 
+    // Slab test. Where a direction component is 0 and the origin lies on a
+    // slab plane, 0 / 0 gives NaN and that axis is ignored, as min and max
+    // return their second operand for NaN.
     bool hit(const ray& r, float tmin, float tmax) const
     {
+        float t_enter, t_exit;
+        return hit(r, tmin, tmax, t_enter, t_exit);
+    }
+
+    // Also returns the part of (tmin, tmax) inside the box.
+    bool hit(const ray& r, float tmin, float tmax, float& t_enter, float& t_exit) const
+    {
+#ifdef VEC3_SSE
+        __m128 o = r.A.m();
+        __m128 d = r.B.m();
+        __m128 ta = _mm_div_ps(_mm_sub_ps(_min.m(), o), d);
+        __m128 tb = _mm_div_ps(_mm_sub_ps(_max.m(), o), d);
+        __m128 lo = _mm_max_ps(_mm_min_ps(ta, tb), _mm_set1_ps(tmin));
+        __m128 hi = _mm_min_ps(_mm_max_ps(ta, tb), _mm_set1_ps(tmax));
+        // reduce lanes 0..2, lane 3 is padding
+        lo = _mm_max_ss(_mm_max_ss(lo, _mm_shuffle_ps(lo, lo, _MM_SHUFFLE(1, 1, 1, 1))),
+                        _mm_shuffle_ps(lo, lo, _MM_SHUFFLE(2, 2, 2, 2)));
+        hi = _mm_min_ss(_mm_min_ss(hi, _mm_shuffle_ps(hi, hi, _MM_SHUFFLE(1, 1, 1, 1))),
+                        _mm_shuffle_ps(hi, hi, _MM_SHUFFLE(2, 2, 2, 2)));
+        t_enter = _mm_cvtss_f32(lo);
+        t_exit = _mm_cvtss_f32(hi);
+        return t_exit > t_enter;
+#else
         for (int a = 0; a < 3; a++) {
             float t0 = ffmin((_min[a] - r.origin()[a]) / r.direction()[a], (_max[a] - r.origin()[a]) / r.direction()[a]);
             float t1 = ffmax((_min[a] - r.origin()[a]) / r.direction()[a], (_max[a] - r.origin()[a]) / r.direction()[a]);
@@ -26,7 +52,16 @@ public:
             if (tmax <= tmin)
                 return false;
         }
+        t_enter = tmin;
+        t_exit = tmax;
         return true;
+#endif
+    }
+
+    float area() const
+    {
+        vec3 d = _max - _min;
+        return 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
     }
 
     vec3 _min, _max;
@@ -34,13 +69,12 @@ public:
 
 aabb surrounding_box(const aabb& a0, const aabb& a1)
 {
-    vec3 small(ffmin(a0.min().x(), a1.min().x()),
-        ffmin(a0.min().y(), a1.min().y()),
-        ffmin(a0.min().z(), a1.min().z()));
-
-    vec3 big(ffmax(a0.max().x(), a1.max().x()),
-        ffmax(a0.max().y(), a1.max().y()),
-        ffmax(a0.max().z(), a1.max().z()));
+    return aabb(min(a0.min(), a1.min()), max(a0.max(), a1.max()));
+}
 
-    return aabb(small, big);
+// Linear interpolation of two boxes, f = 0 gives a0 and f = 1 gives a1.
+aabb interpolate_box(const aabb& a0, const aabb& a1, float f)
+{
+    return aabb((1 - f) * a0.min() + f * a1.min(),
+                (1 - f) * a0.max() + f * a1.max());
 }
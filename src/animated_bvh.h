@@ -0,0 +1,71 @@
+#pragma once
+
+#include "bvh.h"
+#include "sbvh.h"
+
+#include <algorithm>
+#include <thread>
+
+// BVH for animations where primitives move between frames but the set of
+// primitives stays the same. Move primitives, then call update(): it refits
+// the tree and rebuilds it only when the SAH cost grew past
+// rebuild_threshold times the cost right after the last build. Builds are
+// binned SAH by sbvh_builder without spatial splits, since a refit would
+// lose the clipped boxes of split references.
+class animated_bvh : public hitable {
+public:
+    animated_bvh(hitable** l, int n, float t0, float t1, float threshold = 1.5)
+        : list(l)
+        , list_size(n)
+        , time0(t0)
+        , time1(t1)
+        , rebuild_threshold(threshold)
+    {
+        int threads = std::max(1u, std::thread::hardware_concurrency());
+        while ((1 << parallel_depth) < threads)
+            parallel_depth++;
+        build();
+    }
+
+    ~animated_bvh() {
+        delete_bvh(root);
+    }
+
+    bool hit(const ray& r, float tmin, float tmax, hit_info& hit) const {
+        return root->hit(r, tmin, tmax, hit);
+    }
+
+    bool bounding_box(float t0, float t1, aabb& box) const {
+        return root->bounding_box(t0, t1, box);
+    }
+
+    void emitters(std::vector<emitter>& out) const {
+        root->emitters(out);
+    }
+
+    // Returns true if the tree was rebuilt.
+    bool update() {
+        float cost = root->refit(time0, time1, parallel_depth) / root->box.area();
+        if (cost > rebuild_threshold * built_cost) {
+            delete_bvh(root);
+            build();
+            return true;
+        }
+        return false;
+    }
+
+    void build() {
+        sbvh_options options;
+        options.memory_budget = 0;
+        root = build_sbvh(list, list_size, time0, time1, options);
+        built_cost = sah_cost(root, time0, time1);
+    }
+
+    hitable** list;
+    int list_size;
+    float time0, time1;
+    float rebuild_threshold;
+    int parallel_depth = 0;
+    bvh_node* root = nullptr;
+    float built_cost = 0;
+};
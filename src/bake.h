@@ -0,0 +1,75 @@
+#pragma once
+
+#include "grid.h"
+#include "hitable.h"
+#include "texture.h"
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+// Samples f on a resolution^3 grid over box, so lookups interpolate the
+// grid instead of evaluating f. Grids of textures are all baked here.
+template <typename T, typename F>
+grid3<T>* bake_grid(const aabb& box, int resolution, F f)
+{
+    grid3<T>* grid = new grid3<T>(box, resolution);
+    grid->fill(f);
+    return grid;
+}
+
+// Samples the turbulence of tex on a grid over box for static objects.
+// Lookups inside box are then trilinear, others still evaluate the noise.
+// Octaves finer than the grid spacing are blurred.
+void bake_turbulence(noise_texture* tex, const aabb& box, int resolution)
+{
+    delete tex->baked;
+    tex->baked = bake_grid<float>(box, resolution, [tex](const vec3& p) { return tex->noise.turb(p); });
+}
+
+// Evaluates source once per texel ahead of rendering, so shading does a
+// texture lookup instead of running the procedural texture. For static
+// objects only; the result belongs to a material of object alone.
+//
+// If object can map texture coordinates to points, source is rendered over
+// its UV square into a resolution x resolution image with mip levels,
+// averaging 2x2 samples per texel. Colors are clamped to [0, 1] there.
+// Otherwise source is sampled on a grid_resolution^3 grid over the bounding
+// box, which only suits textures that depend on the position alone.
+texture* bake_texture(texture* source, const hitable* object, int resolution, int grid_resolution = 64)
+{
+    vec3 probe;
+    if (!object->point_at_uv(0.5, 0.5, probe)) {
+        aabb box;
+        if (!object->bounding_box(0, 1, box))
+            return source;
+        grid3<vec3>* grid = bake_grid<vec3>(box, grid_resolution, [source](const vec3& p) { return source->value(0, 0, p); });
+        return new grid_texture(grid, source);
+    }
+
+    std::vector<unsigned char> rgba(4 * resolution * resolution, 255);
+    int n = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> threads;
+    for (int t = 0; t < n; t++) {
+        threads.push_back(std::thread([&rgba, source, object, resolution, t, n]() {
+            // rows run from v = 1 at the top, like image::bilinear expects
+            for (int y = t; y < resolution; y += n) {
+                for (int x = 0; x < resolution; x++) {
+                    vec3 sum(0, 0, 0);
+                    for (int s = 0; s < 4; s++) {
+                        float u = (x + 0.25f + 0.5f * (s & 1)) / resolution;
+                        float v = 1 - (y + 0.25f + 0.5f * (s >> 1)) / resolution;
+                        vec3 p(0, 0, 0);
+                        object->point_at_uv(u, v, p);
+                        sum += source->value(u, v, p);
+                    }
+                    for (int c = 0; c < 3; c++)
+                        rgba[4 * (x + resolution * y) + c] = std::clamp(int(255.99f * sum[c] / 4), 0, 255);
+                }
+            }
+        }));
+    }
+    for (auto& t : threads)
+        t.join();
+    return new image_texture(image::from_rgba(rgba.data(), resolution, resolution));
+}
@@ -0,0 +1,614 @@
+#pragma once
+
+#include "aabb.h"
+#include "animated_bvh.h"
+#include "bake.h"
+#include "bvh.h"
+#include "environment.h"
+#include "hitable_list.h"
+#include "light.h"
+#include "packet.h"
+#include "rect.h"
+#include "sbvh.h"
+#include "sphere.h"
+#include "texture.h"
+#include "volume.h"
+#include "wavefront.h"
+
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Microbenchmarks, run by "./executable --bench".
+
+// Calls f(i) for i in [0, n) and returns nanoseconds per call.
+template <typename F>
+double time_per_call(int n, F f)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; i++)
+        f(i);
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / n;
+}
+
+// Calls f once and returns milliseconds.
+template <typename F>
+double time_ms(F f)
+{
+    return time_per_call(1, [&](int) { f(); }) * 1e-6;
+}
+
+// Root mean square of the errors of estimate relative to reference.
+double relative_rms_error(const std::vector<float>& estimate, const std::vector<float>& reference)
+{
+    double squared = 0;
+    for (int k = 0; k < int(reference.size()); k++)
+        squared += std::pow((estimate[k] - reference[k]) / reference[k], 2);
+    return std::sqrt(squared / reference.size());
+}
+
+// Estimates each reference[k] as the mean of samples calls of sample(k),
+// and prints the time per sample and the relative rms error, then note.
+template <typename F>
+void report_estimate(const std::string& name, const std::vector<float>& reference, int samples, F sample, const std::string& note = "")
+{
+    int points = reference.size();
+    std::vector<float> estimate(points, 0);
+    double ns = time_per_call(points * samples, [&](int i) { estimate[i / samples] += sample(i / samples) / samples; });
+    std::cout << name << ": " << ns << " ns per sample, relative rms error "
+              << relative_rms_error(estimate, reference) << note << std::endl;
+}
+
+// Turbulence through the scalar reference, noise4 and baked grids, with
+// errors relative to the reference over points in the baked box.
+void bench_noise()
+{
+    const int n = 1000000;
+    perlin noise;
+    aabb box(vec3(-2, -2, -2), vec3(2, 2, 2));
+    std::vector<vec3> points(n);
+    for (auto& p : points)
+        p = box.min() + vec3(rand_float(), rand_float(), rand_float()) * (box.max() - box.min());
+
+    std::vector<float> reference(n);
+    float sink = 0;
+    double scalar_ns = time_per_call(n, [&](int i) { reference[i] = noise.turb_scalar(points[i]); });
+    double simd_ns = time_per_call(n, [&](int i) { sink += noise.turb(points[i]); });
+    float simd_error = 0;
+    for (int i = 0; i < n; i++)
+        simd_error = std::max(simd_error, std::fabs(noise.turb(points[i]) - reference[i]));
+    std::cout << "turb scalar:  " << scalar_ns << " ns" << std::endl;
+    std::cout << "turb noise4:  " << simd_ns << " ns, max error " << simd_error << std::endl;
+
+    for (int resolution : { 64, 128 }) {
+        std::unique_ptr<grid3<float>> grid;
+        double bake_ms = time_ms([&] { grid.reset(bake_grid<float>(box, resolution, [&noise](const vec3& p) { return noise.turb(p); })); });
+        double baked_ns = time_per_call(n, [&](int i) {
+            float t;
+            grid->lookup(points[i], t);
+            sink += t;
+        });
+        double squared = 0;
+        float max_error = 0;
+        for (int i = 0; i < n; i++) {
+            float t;
+            grid->lookup(points[i], t);
+            float e = std::fabs(t - reference[i]);
+            squared += e * e;
+            max_error = std::max(max_error, e);
+        }
+        std::cout << "turb baked " << resolution << "^3: " << baked_ns << " ns, rms error "
+                  << std::sqrt(squared / n) << ", max error " << max_error
+                  << ", bake " << bake_ms << " ms" << std::endl;
+    }
+    if (sink == 42)
+        std::cout << std::endl;
+}
+
+// Random rays from a sphere of radius shell around the origin towards points
+// in a cube of side spread around it. By default roughly half of them hit the
+// unit sphere and box.
+std::vector<ray> bench_rays(int n, float shell = 4, float spread = 4)
+{
+    std::vector<ray> rays(n);
+    for (auto& r : rays) {
+        vec3 o = shell * unit_vector(vec3(rand_float() - 0.5f, rand_float() - 0.5f, rand_float() - 0.5f));
+        vec3 target = spread * vec3(rand_float() - 0.5f, rand_float() - 0.5f, rand_float() - 0.5f);
+        r = ray(o, target - o);
+    }
+    return rays;
+}
+
+void bench_sphere_hit()
+{
+    const int n = 1000000;
+    std::vector<ray> rays = bench_rays(n);
+    sphere s(vec3(0, 0, 0), 1, nullptr);
+    int hits = 0;
+    double ns = time_per_call(n, [&](int i) {
+        hit_info hit;
+        hits += s.hit(rays[i], 0.001f, 1e9f, hit);
+    });
+    std::cout << "sphere::hit: " << ns << " ns, " << hits << " hits" << std::endl;
+}
+
+void bench_aabb_hit()
+{
+    const int n = 1000000;
+    std::vector<ray> rays = bench_rays(n);
+    aabb box(vec3(-1, -1, -1), vec3(1, 1, 1));
+    int hits = 0;
+    double ns = time_per_call(n, [&](int i) { hits += box.hit(rays[i], 0.001f, 1e9f); });
+    std::cout << "aabb::hit:   " << ns << " ns, " << hits << " hits" << std::endl;
+}
+
+// Closest hit and surface of a box by the slab test, and of the same box
+// with six different materials, kept as a list of rects.
+void bench_box()
+{
+    const int n = 1000000;
+    std::vector<ray> rays = bench_rays(n);
+    material* faces[6];
+    for (int f = 0; f < 6; f++)
+        faces[f] = new lambertian(new constant_texture(vec3(f / 5.0, 0.5, 0.5)));
+    box slab(vec3(-1, -1, -1), vec3(1, 1, 1), faces[0]);
+    box rects(vec3(-1, -1, -1), vec3(1, 1, 1), faces);
+    for (const box* b : { &slab, &rects }) {
+        int hits = 0;
+        hit_info hit;
+        hit_record rec;
+        double ns = time_per_call(n, [&](int i) {
+            if (b->hit(rays[i], 0.001f, 1e9f, hit)) {
+                finish_hit(rays[i], hit, rec);
+                hits++;
+            }
+        });
+        std::cout << "box " << (b == &slab ? "slab" : "rects") << ": " << ns << " ns, " << hits << " hits" << std::endl;
+    }
+}
+
+// Entry and exit of constant_medium boundaries, by the generic two hits and
+// by the closed-form hit_interval of sphere and box.
+void bench_medium_boundary()
+{
+    const int n = 1000000;
+    std::vector<ray> rays = bench_rays(n);
+    sphere s(vec3(0, 0, 0), 1, nullptr);
+    box b(vec3(-1, -1, -1), vec3(1, 1, 1), (material*)nullptr);
+    for (const hitable* h : { (const hitable*)&s, (const hitable*)&b }) {
+        int hits = 0;
+        float t0, t1;
+        double generic_ns = time_per_call(n, [&](int i) { hits += h->hitable::hit_interval(rays[i], 0.001f, 1e9f, t0, t1); });
+        double closed_ns = time_per_call(n, [&](int i) { hits += h->hit_interval(rays[i], 0.001f, 1e9f, t0, t1); });
+        std::cout << (h == &s ? "sphere" : "box") << " interval: two hits " << generic_ns << " ns, closed form "
+                  << closed_ns << " ns" << std::endl;
+    }
+}
+
+// A noise cloud of fixed size in boxes of growing size at the same voxel
+// size. grid_medium should cost about the same in every box, while delta
+// tracking against one majorant for the whole box grows with it. The
+// fraction of rays colliding should agree between the two.
+void bench_media()
+{
+    const int n = 200000;
+    const float radius = 1;
+    perlin noise;
+    auto cloud = [&noise, radius](const vec3& p) {
+        float falloff = 1 - p.length() / radius;
+        return falloff > 0 ? falloff * noise.turb(4 * p) * 4 : 0.0f;
+    };
+    for (int k : { 1, 2, 4 }) {
+        float half = 1.1f * radius * k;
+        brick_grid grid(aabb(vec3(-half, -half, -half), vec3(half, half, half)), 48 * k);
+        grid.fill(cloud);
+        grid_medium medium(&grid, 1, nullptr);
+
+        std::vector<ray> rays = bench_rays(n, 2 * half, radius);
+        int collisions = 0;
+        double grid_ns = time_per_call(n, [&](int i) {
+            hit_info hit;
+            collisions += medium.hit(rays[i], 0.001f, 1e9f, hit);
+        });
+
+        // the same tracking with the majorant of the whole box
+        float majorant = grid.max_majorant();
+        int dense_collisions = 0;
+        double dense_ns = time_per_call(n, [&](int i) {
+            const ray& r = rays[i];
+            float t_enter, t_exit;
+            if (!grid.box.hit(r, 0, 1e9f, t_enter, t_exit))
+                return;
+            float sigma = majorant * r.direction().length();
+            for (float t = t_enter;;) {
+                t -= std::log(1 - rand_float()) / sigma;
+                if (t >= t_exit)
+                    break;
+                if (rand_float() * majorant < grid.density(r.point_at_parameter(t))) {
+                    dense_collisions++;
+                    break;
+                }
+            }
+        });
+        std::cout << "medium " << grid.resolution << "^3 voxels, " << grid.stored_bricks() << " of "
+                  << grid.bricks * grid.bricks * grid.bricks << " bricks, " << grid.size_in_bytes() / 1024 << " KB: "
+                  << "bricks " << grid_ns << " ns (" << float(collisions) / n << " collide), "
+                  << "one majorant " << dense_ns << " ns (" << float(dense_collisions) / n << " collide)" << std::endl;
+    }
+}
+
+// Direct light from 4096 small emitters on two facing walls at points on
+// the floor between them, without shadows. One emitter is picked uniformly
+// or by light_bvh, and a point on it sampled. Errors are relative to the sum
+// over all emitters, at 16 samples per shading point.
+void bench_light_sampling()
+{
+    const int emitters = 4096;
+    const int points = 256;
+    const int samples = 16;
+    hitable** list = new hitable*[emitters];
+    for (int i = 0; i < emitters; i++) {
+        // side -1 is the wall at z = -10 facing +z, side 1 the one at z = 10
+        int side = i % 2 ? 1 : -1;
+        vec3 corner(100 * rand_float() - 50, 1 + 10 * rand_float(), 10 * side);
+        triangle_parameter param;
+        param.v0 = corner;
+        param.v1 = corner + (side > 0 ? vec3(0.5, 0.3, 0) : vec3(0.5, 0, 0));
+        param.v2 = corner + (side > 0 ? vec3(0.5, 0, 0) : vec3(0.5, 0.3, 0));
+        list[i] = new triangle(param, new diffuse_light(new constant_texture(vec3(1, 1, 1) * (1 + 20 * rand_float()))));
+    }
+    hitable_list world(list, emitters);
+    std::unique_ptr<light_bvh> lights;
+    double build_ms = time_ms([&] { lights.reset(new light_bvh(&world)); });
+
+    // light from e at p with normal n through a point sampled by u1, u2,
+    // per unit of probability density on e
+    vec3 n(0, 1, 0);
+    auto light_from = [&n](const emitter& e, const vec3& p, float u1, float u2) {
+        vec3 d = e.point(u1, u2) - p;
+        float distance = d.length();
+        float cosines = std::max(dot(n, d), 0.0f) * std::max(-dot(e.normal(), d), 0.0f) / (distance * distance);
+        return e.radiance[0] * cosines / (distance * distance) * e.area();
+    };
+    std::vector<vec3> p(points);
+    std::vector<float> reference(points, 0);
+    for (int k = 0; k < points; k++) {
+        p[k] = vec3(100 * rand_float() - 50, 0, 18 * rand_float() - 9);
+        for (const emitter& e : lights->lights) {
+            for (int s = 0; s < 16; s++)
+                reference[k] += light_from(e, p[k], (s % 4 + rand_float()) / 4, (s / 4 + rand_float()) / 4) / 16;
+        }
+    }
+
+    const std::vector<emitter>& all = lights->lights;
+    report_estimate("lights uniform", reference, samples, [&](int k) {
+        int light = std::min(int(rand_float() * all.size()), int(all.size()) - 1);
+        return light_from(all[light], p[k], rand_float(), rand_float()) * all.size();
+    });
+    report_estimate("lights light_bvh", reference, samples, [&](int k) {
+        float pmf;
+        int light = lights->sample(p[k], n, rand_float(), pmf);
+        return light >= 0 ? light_from(all[light], p[k], rand_float(), rand_float()) / pmf : 0.0f;
+    }, ", built in " + std::to_string(build_ms) + " ms");
+}
+
+// Irradiance from a sky with a small sun at random normals, by cosine
+// weighted directions as diffuse scattering picks them and by sampling the
+// environment map.
+void bench_environment_sampling()
+{
+    const int width = 1024, height = 512;
+    const int normals = 256;
+    const int samples = 16;
+    // blue sky getting brighter toward the horizon, black below it, and a
+    // sun 2 degrees wide 40 degrees up
+    std::vector<float> rgb(3 * width * height);
+    vec3 sun = unit_vector(vec3(1, tan(40 * M_PI / 180), 0.5));
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            float u = (x + 0.5f) / width;
+            float v = 1 - (y + 0.5f) / height;
+            float phi = (1 - u) * 2 * M_PI - M_PI;
+            float theta = v * M_PI - M_PI / 2;
+            vec3 d(cos(theta) * cos(phi), sin(theta), cos(theta) * sin(phi));
+            vec3 c = d.y() > 0 ? vec3(0.3, 0.5, 1.0) * (1 - 0.5f * d.y()) : vec3(0, 0, 0);
+            if (dot(d, sun) > cos(M_PI / 180))
+                c = vec3(20000, 18000, 15000);
+            std::copy(&c[0], &c[0] + 3, &rgb[3 * (x + width * y)]);
+        }
+    }
+    std::unique_ptr<environment> sky;
+    double build_ms = time_ms([&] { sky.reset(new environment(rgb.data(), width, height)); });
+
+    // The reference sums the texels, each seen from its center and covering
+    // its exact solid angle, so it does not depend on sky.sample() or pdf().
+    std::vector<vec3> texel_direction;
+    std::vector<float> texel_power;
+    for (int y = 0; y < height; y++) {
+        float theta0 = M_PI / 2 - M_PI * (y + 1) / height;
+        float theta1 = M_PI / 2 - M_PI * y / height;
+        float solid_angle = 2 * M_PI / width * (sin(theta1) - sin(theta0));
+        for (int x = 0; x < width; x++) {
+            float power = rgb[3 * (x + width * y)] * solid_angle;
+            if (power == 0)
+                continue;
+            float phi = (1 - (x + 0.5f) / width) * 2 * M_PI - M_PI;
+            float theta = (theta0 + theta1) / 2;
+            texel_direction.push_back(vec3(cos(theta) * cos(phi), sin(theta), cos(theta) * sin(phi)));
+            texel_power.push_back(power);
+        }
+    }
+    std::vector<vec3> n(normals);
+    std::vector<float> reference(normals, 0);
+    for (int k = 0; k < normals; k++) {
+        // facing up, so every normal sees some sky
+        float y = rand_float(), a = 2 * M_PI * rand_float();
+        n[k] = vec3(sqrt(1 - y * y) * cos(a), y, sqrt(1 - y * y) * sin(a));
+        double sum = 0;
+        for (int t = 0; t < int(texel_power.size()); t++)
+            sum += texel_power[t] * std::max(dot(n[k], texel_direction[t]), 0.0f);
+        reference[k] = sum;
+    }
+
+    // radiance times cosine over the density of picking d, weighted against
+    // the other strategy by mis
+    auto cosine_sample = [&](const vec3& n, bool mis) {
+        vec3 d = random_cosine_direction(n);
+        float cosine = std::max(dot(n, d), 0.0f);
+        if (cosine <= 0)
+            return 0.0f;
+        float weight = mis ? light_bvh::power_heuristic(cosine / M_PI, sky->pdf(d)) : 1;
+        return weight * sky->radiance(d)[0] * float(M_PI);
+    };
+    auto environment_sample = [&](const vec3& n, bool mis) {
+        vec3 d;
+        float pdf;
+        if (!sky->sample(rand_float(), rand_float(), rand_float(), d, pdf))
+            return 0.0f;
+        float cosine = std::max(dot(n, d), 0.0f);
+        float weight = mis ? light_bvh::power_heuristic(pdf, cosine / M_PI) : 1;
+        return weight * sky->radiance(d)[0] * cosine / pdf;
+    };
+    report_estimate("sky cosine", reference, samples, [&](int k) { return cosine_sample(n[k], false); });
+    report_estimate("sky environment", reference, samples, [&](int k) { return environment_sample(n[k], false); },
+                    ", alias table built in " + std::to_string(build_ms) + " ms");
+    report_estimate("sky both by mis", reference, samples, [&](int k) { return cosine_sample(n[k], true) + environment_sample(n[k], true); });
+}
+
+// Points in the unit disk and ball and diffuse directions, by the rejection
+// loops common.h used to have and by its closed-form samplers. Numbers come
+// from an independent_sampler, as in rendering.
+void bench_sampling()
+{
+    const int n = 1 << 20;
+    independent_sampler numbers;
+    sampler::current = &numbers;
+    numbers.start(0, 0, 0);
+    vec3 normal = unit_vector(vec3(0.3, 0.9, -0.2));
+    vec3 sum(0, 0, 0);
+    auto report = [&](const char* name, int dimensions, double ns) {
+        std::cout << "sampling " << name << ": " << ns << " ns, " << float(numbers.dimension() - dimensions) / n << " numbers per sample" << std::endl;
+    };
+
+    int first = numbers.dimension();
+    double ns = time_per_call(n, [&](int) {
+        vec3 p;
+        do {
+            p = 2 * vec3(rand_float() - 0.5f, rand_float() - 0.5f, 0);
+        } while (dot(p, p) >= 1);
+        sum += p;
+    });
+    report("disk by rejection", first, ns);
+    first = numbers.dimension();
+    ns = time_per_call(n, [&](int) { sum += random_in_unit_disk(); });
+    report("disk concentric", first, ns);
+
+    first = numbers.dimension();
+    ns = time_per_call(n, [&](int) {
+        vec3 p;
+        do {
+            p = 2 * vec3(rand_float() - 0.5f, rand_float() - 0.5f, rand_float() - 0.5f);
+        } while (p.length() >= 1);
+        sum += p;
+    });
+    report("ball by rejection", first, ns);
+    first = numbers.dimension();
+    ns = time_per_call(n, [&](int) { sum += random_in_unit_sphere(); });
+    report("ball closed form", first, ns);
+
+    first = numbers.dimension();
+    ns = time_per_call(n, [&](int) {
+        vec3 d;
+        do {
+            vec3 p;
+            do {
+                p = 2 * vec3(rand_float() - 0.5f, rand_float() - 0.5f, rand_float() - 0.5f);
+            } while (p.length() >= 1 || p.norm() == 0);
+            d = normal + unit_vector(p);
+        } while (d.norm() < 1e-12f);
+        sum += unit_vector(d);
+    });
+    report("diffuse by rejection", first, ns);
+    first = numbers.dimension();
+    ns = time_per_call(n, [&](int) { sum += random_cosine_direction(normal); });
+    report("diffuse cosine", first, ns);
+
+    // the mapping alone, over numbers already drawn
+    std::vector<float> u(2 * n);
+    for (float& x : u)
+        x = rand_float();
+    std::vector<vec3> points(n);
+    ns = time_per_call(1, [&](int) {
+        for (int i = 0; i < n; i++)
+            points[i] = concentric_disk(u[2 * i], u[2 * i + 1]);
+    }) / n;
+    std::cout << "sampling concentric_disk over arrays: " << ns << " ns" << std::endl;
+    sampler::current = nullptr;
+    for (const vec3& p : points)
+        sum += p;
+    if (sum.x() == 12345)
+        std::cout << std::endl;
+}
+
+// Primary rays as 8x8 packets and first diffuse bounces as sorted streams,
+// against single rays, on a world laid out like the scenes in main.cpp: a
+// hitable_list around a 80k triangle terrain under an SBVH, a floor and a
+// sphere.
+void bench_ray_coherence()
+{
+    const int grid = 200;
+    material* mat = new lambertian(new constant_texture(vec3(0.5, 0.5, 0.5)));
+    std::vector<hitable*> triangles;
+    auto height = [](int x, int z) { return 0.5f * sin(0.11f * x) * cos(0.07f * z) + 0.2f * sin(0.37f * x + 0.23f * z); };
+    for (int z = 0; z < grid; z++) {
+        for (int x = 0; x < grid; x++) {
+            vec3 p00(x * 0.05f - 5, height(x, z), z * 0.05f - 5), p10((x + 1) * 0.05f - 5, height(x + 1, z), z * 0.05f - 5);
+            vec3 p01(x * 0.05f - 5, height(x, z + 1), (z + 1) * 0.05f - 5), p11((x + 1) * 0.05f - 5, height(x + 1, z + 1), (z + 1) * 0.05f - 5);
+            triangle_parameter a, b;
+            a.v0 = p00, a.v1 = p11, a.v2 = p10;
+            b.v0 = p00, b.v1 = p01, b.v2 = p11;
+            triangles.push_back(new triangle(a, mat));
+            triangles.push_back(new triangle(b, mat));
+        }
+    }
+    hitable** list = new hitable*[3];
+    list[0] = build_sbvh(triangles.data(), triangles.size(), 0, 1);
+    list[1] = new xz_rect(-50, 50, -50, 50, -1, mat);
+    list[2] = new sphere(vec3(0, 1.5, 0), 1, mat);
+    hitable_list world(list, 3);
+
+    // a 256 x 256 pinhole image from above the terrain
+    const int width = 256;
+    vec3 eye(0, 4, -9);
+    vec3 forward = unit_vector(vec3(0, -0.4, 1)), right = unit_vector(cross(forward, vec3(0, 1, 0))), up = cross(right, forward);
+    std::vector<ray> primary;
+    for (int ty = 0; ty < width; ty += 8)
+        for (int tx = 0; tx < width; tx += 8)
+            for (int y = ty; y < ty + 8; y++)
+                for (int x = tx; x < tx + 8; x++)
+                    primary.push_back(ray(eye, forward + (x / float(width) - 0.5f) * right + (y / float(width) - 0.5f) * up));
+    int n = primary.size();
+
+    std::vector<hit_info> single(n);
+    std::vector<char> single_hits(n);
+    double single_ns = time_per_call(n, [&](int i) { single_hits[i] = world.hit(primary[i], 0.001, 1e9, single[i]); });
+    ray_packet packet;
+    int mismatches = 0;
+    double packet_ns = time_per_call(n / 64, [&](int k) {
+        packet.clear();
+        for (int i = 64 * k; i < 64 * k + 64; i++)
+            packet.add(primary[i]);
+        packet.intersect(&world, 0.001, 1e9);
+        for (int i = 0; i < 64; i++)
+            mismatches += packet.hits[i] != single_hits[64 * k + i] || (packet.hits[i] && packet.infos[i].t != single[64 * k + i].t);
+    }) / 64;
+    std::cout << "primary rays: single " << single_ns << " ns, 8x8 packets " << packet_ns << " ns per ray, "
+              << packet.frustum_culls << " frustum culls, " << mismatches << " mismatches" << std::endl;
+
+    // the first diffuse bounce off every primary hit
+    std::vector<wavefront_path> paths;
+    for (int i = 0; i < n; i++) {
+        if (!single_hits[i])
+            continue;
+        hit_record rec;
+        finish_hit(primary[i], single[i], rec);
+        wavefront_path path;
+        path.r = ray(rec.p, random_cosine_direction(rec.normal));
+        paths.push_back(path);
+    }
+    int m = paths.size();
+    std::vector<char> bounce_hits(m);
+    single_ns = time_per_call(m, [&](int i) { bounce_hits[i] = world.hit(paths[i].r, 0.001, 1e9, paths[i].hit); });
+    int single_count = 0;
+    for (char h : bounce_hits)
+        single_count += h;
+    ray_stream stream;
+    std::vector<char> stream_hits;
+    double stream_ns = time_per_call(1, [&](int) { stream.intersect(paths, &world, stream_hits); }) / m;
+    int stream_count = 0;
+    for (char h : stream_hits)
+        stream_count += h;
+    std::cout << "bounce rays: single " << single_ns << " ns, sorted streams of 1024 " << stream_ns << " ns per ray, "
+              << float(stream.box_tests) / stream.node_fetches << " rays per node fetch, hits " << single_count << " vs " << stream_count << std::endl;
+}
+
+// Spheres drifting over frames, kept in an animated_bvh, slowly and then
+// fast enough for refitted trees to degrade. Frames update() only refitted
+// and frames it rebuilt are timed apart, against building a new bvh_node
+// every frame. After the last frame, rays are traced through both trees and
+// their hits compared.
+void bench_animated_bvh()
+{
+    const int n = 100000, frames = 20, rays_count = 10000;
+    for (float speed : { 0.02f, 0.5f }) {
+        std::vector<sphere*> spheres(n);
+        std::vector<vec3> velocities(n);
+        std::vector<hitable*> list(n);
+        for (int i = 0; i < n; i++) {
+            vec3 center = 20 * vec3(rand_float() - 0.5f, rand_float() - 0.5f, rand_float() - 0.5f);
+            spheres[i] = new sphere(center, 0.05, nullptr);
+            velocities[i] = speed * vec3(rand_float() - 0.5f, rand_float() - 0.5f, rand_float() - 0.5f);
+            list[i] = spheres[i];
+        }
+
+        animated_bvh animated(list.data(), n, 0, 1);
+        std::vector<hitable*> copy(n);
+        bvh_node* built = nullptr;
+        double refit_ms = 0, rebuild_ms = 0, build_ms = 0;
+        int rebuilds = 0;
+        for (int frame = 0; frame < frames; frame++) {
+            for (int i = 0; i < n; i++)
+                spheres[i]->center += velocities[i];
+            bool rebuilt = false;
+            double ms = time_ms([&] { rebuilt = animated.update(); });
+            (rebuilt ? rebuild_ms : refit_ms) += ms;
+            rebuilds += rebuilt;
+            if (built)
+                delete_bvh(built);
+            copy.assign(spheres.begin(), spheres.end());
+            build_ms += time_ms([&] { built = new bvh_node(copy.data(), n, 0, 1); });
+        }
+        std::vector<ray> rays = bench_rays(rays_count, 20, 20);
+        std::vector<hit_info> hits(rays_count);
+        std::vector<char> hit_any(rays_count);
+        double built_ns = time_per_call(rays_count, [&](int i) { hit_any[i] = built->hit(rays[i], 0.001, 1e9, hits[i]); });
+        int mismatches = 0;
+        double animated_ns = time_per_call(rays_count, [&](int i) {
+            hit_info hit;
+            bool h = animated.hit(rays[i], 0.001, 1e9, hit);
+            mismatches += h != bool(hit_any[i]) || (h && hit.t != hits[i].t);
+        });
+        std::cout << "animated_bvh, speed " << speed << ": refit " << refit_ms / std::max(1, frames - rebuilds)
+                  << " ms in " << frames - rebuilds << " frames, rebuild " << rebuild_ms / std::max(1, rebuilds)
+                  << " ms in " << rebuilds << ", new bvh_node " << build_ms / frames << " ms per frame" << std::endl;
+        std::cout << "animated_bvh rays, speed " << speed << ": " << animated_ns << " ns, new bvh_node " << built_ns
+                  << " ns, SAH cost " << sah_cost(animated.root, 0, 1) << " vs " << sah_cost(built, 0, 1)
+                  << ", " << mismatches << " mismatches" << std::endl;
+        delete_bvh(built);
+        for (sphere* s : spheres)
+            delete s;
+    }
+}
+
+int run_benchmarks()
+{
+    std::cout << "sizeof(vec3) " << sizeof(vec3) << ", sizeof(ray) " << sizeof(ray)
+              << ", sizeof(hit_info) " << sizeof(hit_info)
+              << ", sizeof(hit_record) " << sizeof(hit_record) << std::endl;
+    bench_sphere_hit();
+    bench_aabb_hit();
+    bench_noise();
+    bench_box();
+    bench_medium_boundary();
+    bench_media();
+    bench_light_sampling();
+    bench_environment_sampling();
+    bench_sampling();
+    bench_ray_coherence();
+    bench_animated_bvh();
+    return 0;
+}
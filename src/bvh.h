@@ -5,42 +5,58 @@
 #include "hitable.h"
 
 #include <algorithm>
+#include <thread>
+#include <vector>
+
+// relative costs used by the surface area heuristic
+const float bvh_traversal_cost = 1.0;
+const float bvh_intersection_cost = 1.0;
 
 class bvh_node : public hitable {
 public:
     bvh_node() {}
     bvh_node(hitable** l, int n, float t0, float t1);
-    bool hit(const ray& r, float tmin, float tmax, hit_record& rec) const;
+    bool hit(const ray& r, float tmin, float tmax, hit_info& hit) const;
     bool bounding_box(float t0, float t1, aabb& box) const;
+    void emitters(std::vector<emitter>& out) const;
+    float refit(float t0, float t1, int parallel_depth = 0);
     hitable* left = nullptr;
     hitable* right = nullptr;
     aabb box;
+    // children are primitives, not bvh_nodes made by the constructor
+    bool leaf = true;
+    // of a leaf, whether its children are bvh_nodes all the same, like the
+    // BVHs of meshes under a top-level one, for coherent traversals
+    bool left_nested = false;
+    bool right_nested = false;
+
+    // Sets left_nested and right_nested of a leaf from its children.
+    void mark_nested() {
+        left_nested = dynamic_cast<const bvh_node*>(left) != nullptr;
+        right_nested = dynamic_cast<const bvh_node*>(right) != nullptr;
+    }
 };
 
-bool bvh_node::bounding_box(float t0, float t1, aabb& b) const
+bool bvh_node::bounding_box(float, float, aabb& b) const
 {
     b = box;
     return true;
 }
 
-bool bvh_node::hit(const ray& r, float tmin, float tmax, hit_record& rec) const
+void bvh_node::emitters(std::vector<emitter>& out) const
+{
+    left->emitters(out);
+    if (right != left)
+        right->emitters(out);
+}
+
+bool bvh_node::hit(const ray& r, float tmin, float tmax, hit_info& hit) const
 {
     if (box.hit(r, tmin, tmax)) {
-        hit_record rec_left, rec_right;
-        bool hit_left = left->hit(r, tmin, tmax, rec_left);
-        bool hit_right = right->hit(r, tmin, tmax, rec_right);
-        if (hit_left && hit_right) {
-            if (rec_left.t < rec_right.t)
-                rec = rec_left;
-            else
-                rec = rec_right;
-        } else if (hit_left)
-            rec = rec_left;
-        else if (hit_right)
-            rec = rec_right;
-        else
-            return false;
-        return true;
+        // hit is only overwritten by closer hits, so right may reuse it.
+        bool hit_left = left->hit(r, tmin, tmax, hit);
+        bool hit_right = right->hit(r, tmin, hit_left ? hit.t : tmax, hit);
+        return hit_left || hit_right;
     }
     return false;
 }
@@ -79,7 +95,7 @@ bvh_node::bvh_node(hitable** l, int n, float t0, float t1)
         std::sort(l, l + n, compare_box_x);
     else if (axis == 1)
         std::sort(l, l + n, compare_box_y);
-    else if (axis == 1)
+    else
         std::sort(l, l + n, compare_box_z);
 
     if (n == 1)
@@ -90,9 +106,174 @@ bvh_node::bvh_node(hitable** l, int n, float t0, float t1)
     } else {
         left = new bvh_node(l, n / 2, t0, t1);
         right = new bvh_node(l + n / 2, n - n / 2, t0, t1);
+        leaf = false;
     }
+    if (leaf)
+        mark_nested();
     aabb box_left, box_right;
     if (!left->bounding_box(t0, t1, box_left) || !right->bounding_box(t0, t1, box_right))
         std::cerr << "No bounding box in bvh_node constructor!" << std::endl;
     box = surrounding_box(box_left, box_right);
 }
+
+// Recomputes boxes bottom-up after primitives moved, keeping the topology.
+// Both subtrees of the top parallel_depth levels are refitted concurrently.
+// Returns the unnormalized SAH cost of the subtree (see sah_cost()).
+float bvh_node::refit(float t0, float t1, int parallel_depth)
+{
+    float cost = 0;
+    aabb box_left, box_right;
+    if (!left->bounding_box(t0, t1, box_left) || !right->bounding_box(t0, t1, box_right))
+        std::cerr << "No bounding box in bvh_node::refit!" << std::endl;
+    if (!leaf) {
+        bvh_node* l = static_cast<bvh_node*>(left);
+        bvh_node* r = static_cast<bvh_node*>(right);
+        if (parallel_depth > 0) {
+            float cost_left = 0;
+            std::thread th([l, t0, t1, parallel_depth, &cost_left]() { cost_left = l->refit(t0, t1, parallel_depth - 1); });
+            cost += r->refit(t0, t1, parallel_depth - 1);
+            th.join();
+            cost += cost_left;
+        } else {
+            cost += l->refit(t0, t1);
+            cost += r->refit(t0, t1);
+        }
+        box_left = l->box;
+        box_right = r->box;
+    } else {
+        cost += bvh_intersection_cost * box_left.area();
+        if (left != right)
+            cost += bvh_intersection_cost * box_right.area();
+    }
+    box = surrounding_box(box_left, box_right);
+    return cost + bvh_traversal_cost * box.area();
+}
+
+// Deletes the nodes made by the bvh_node constructor, not the primitives.
+void delete_bvh(bvh_node* node)
+{
+    if (!node->leaf) {
+        delete_bvh(static_cast<bvh_node*>(node->left));
+        delete_bvh(static_cast<bvh_node*>(node->right));
+    }
+    delete node;
+}
+
+// Surface area heuristic cost of the tree, relative to one primitive
+// intersection for a ray hitting the root box.
+float sah_cost(const bvh_node* node, float t0, float t1)
+{
+    float root_area = node->box.area();
+    float cost = 0;
+    std::vector<const bvh_node*> stack { node };
+    while (!stack.empty()) {
+        const bvh_node* n = stack.back();
+        stack.pop_back();
+        cost += bvh_traversal_cost * n->box.area();
+        if (n->leaf) {
+            for (const hitable* child : { n->left, n->right }) {
+                aabb b;
+                if (child->bounding_box(t0, t1, b))
+                    cost += bvh_intersection_cost * b.area();
+                if (n->left == n->right)
+                    break;
+            }
+        } else {
+            stack.push_back(static_cast<const bvh_node*>(n->left));
+            stack.push_back(static_cast<const bvh_node*>(n->right));
+        }
+    }
+    return root_area > 0 ? cost / root_area : cost;
+}
+
+// BVH for moving objects. Each node stores its bounds at time_keys instants
+// spread evenly over [time0, time1] and tests the box interpolated to
+// ray::time(), instead of one box covering the whole shutter interval.
+// Interpolated boxes are conservative as long as objects move linearly
+// between keys, like moving_sphere.
+class motion_bvh_node : public hitable {
+public:
+    static constexpr int time_keys = 2;
+
+    motion_bvh_node() {}
+    motion_bvh_node(hitable** l, int n, float t0, float t1);
+    bool hit(const ray& r, float tmin, float tmax, hit_info& hit) const;
+    bool bounding_box(float t0, float t1, aabb& box) const;
+    void emitters(std::vector<emitter>& out) const;
+    aabb box_at(float time) const;
+    float key_time(int k) const { return time0 + (time1 - time0) * k / (time_keys - 1); }
+    hitable* left = nullptr;
+    hitable* right = nullptr;
+    aabb boxes[time_keys];
+    float time0, time1;
+};
+
+aabb motion_bvh_node::box_at(float time) const
+{
+    // zero-length shutter, every key holds the same box
+    if (!(time1 > time0))
+        return boxes[0];
+    float s = (time - time0) / (time1 - time0) * (time_keys - 1);
+    s = std::clamp(s, 0.0f, float(time_keys - 1));
+    int k = std::min(int(s), time_keys - 2);
+    return interpolate_box(boxes[k], boxes[k + 1], s - k);
+}
+
+bool motion_bvh_node::bounding_box(float t0, float t1, aabb& b) const
+{
+    b = surrounding_box(box_at(t0), box_at(t1));
+    for (int k = 0; k < time_keys; k++) {
+        if (t0 < key_time(k) && key_time(k) < t1)
+            b = surrounding_box(b, boxes[k]);
+    }
+    return true;
+}
+
+void motion_bvh_node::emitters(std::vector<emitter>& out) const
+{
+    left->emitters(out);
+    if (right != left)
+        right->emitters(out);
+}
+
+bool motion_bvh_node::hit(const ray& r, float tmin, float tmax, hit_info& hit) const
+{
+    if (box_at(r.time()).hit(r, tmin, tmax)) {
+        bool hit_left = left->hit(r, tmin, tmax, hit);
+        bool hit_right = right->hit(r, tmin, hit_left ? hit.t : tmax, hit);
+        return hit_left || hit_right;
+    }
+    return false;
+}
+
+motion_bvh_node::motion_bvh_node(hitable** l, int n, float t0, float t1)
+    : time0(t0)
+    , time1(t1)
+{
+    // Split at the median of box centers in the middle of the interval.
+    int axis = int(3 * rand_float());
+    float mid = (t0 + t1) / 2;
+    std::sort(l, l + n, [axis, mid](hitable* a, hitable* b) {
+        aabb box_a, box_b;
+        if (!a->bounding_box(mid, mid, box_a) || !b->bounding_box(mid, mid, box_b))
+            std::cerr << "No bounding box in motion_bvh_node constructor!" << std::endl;
+        return box_a.min()[axis] + box_a.max()[axis] < box_b.min()[axis] + box_b.max()[axis];
+    });
+
+    if (n == 1)
+        left = right = l[0];
+    else if (n == 2) {
+        left = l[0];
+        right = l[1];
+    } else {
+        left = new motion_bvh_node(l, n / 2, t0, t1);
+        right = new motion_bvh_node(l + n / 2, n - n / 2, t0, t1);
+    }
+    for (int k = 0; k < time_keys; k++) {
+        float t = key_time(k);
+        aabb box_left, box_right;
+        if (!left->bounding_box(t, t, box_left) || !right->bounding_box(t, t, box_right))
+            std::cerr << "No bounding box in motion_bvh_node constructor!" << std::endl;
+        boxes[k] = surrounding_box(box_left, box_right);
+    }
+}
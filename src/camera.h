@@ -11,8 +11,8 @@ public:
         lens_radius = aperture / 2;
         time0 = t0;
         time1 = t1;
-        float theta = vfov * 3.1415926535 / 180;
-        float half_height = tan(theta / 2);
+        float theta = vfov * float(M_PI) / 180;
+        half_height = tan(theta / 2);
         float half_width = aspect * half_height;
         origin = lookfrom;
         w = unit_vector(lookfrom - lookat);
@@ -25,15 +25,22 @@ public:
         vertical = 2  * half_height * focus_dist * v;
     }
 
+    // Needed for texture filtering, ny is the image height in pixels.
+    void set_image_height(int ny) {
+        pixel_spread = 2 * half_height / ny;
+    }
+
     ray get_ray(float s, float t) const {
         vec3 rd = lens_radius * random_in_unit_disk();
         vec3 offset = u * rd.x() + v * rd.y();
         float time = time0 + rand_float() * (time1-time0);
-        return ray(origin + offset,
-                  lower_left_corner +
-                  s * horizontal +
-                  t * vertical - origin - offset,
-                  time);
+        ray r(origin + offset,
+              lower_left_corner +
+              s * horizontal +
+              t * vertical - origin - offset,
+              time);
+        r.cone_spread = pixel_spread;
+        return r;
     }
 
     vec3 u, v, w;
@@ -43,4 +50,7 @@ public:
     vec3 origin;
     float lens_radius;
     float time0, time1;
+    float half_height;
+    // angle covered by one pixel
+    float pixel_spread = 0;
 };
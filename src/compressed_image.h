@@ -0,0 +1,162 @@
+#pragma once
+
+#include "image.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Image kept in memory in the BC1 (DXT1) block format: every 4x4 texel block
+// is two RGB565 end point colors and a 2-bit index per texel choosing one of
+// them or one of two colors between them. That is 8 bytes per block instead
+// of 64 as RGBA8, and a lookup decodes only the texel it needs. Alpha is
+// dropped, which sampling ignores anyway.
+class compressed_image : public mipmapped_image {
+public:
+    struct block {
+        uint16_t color0, color1;
+        uint32_t indices; // 2 bits per texel, row-major from the low bits
+    };
+
+    static std::shared_ptr<compressed_image> encode(const image& img) {
+        auto c = std::make_shared<compressed_image>();
+        for (const mip_level& l : img.levels) {
+            compressed_level level;
+            level.width = l.width;
+            level.height = l.height;
+            level.blocks_x = (l.width + 3) / 4;
+            int blocks_y = (l.height + 3) / 4;
+            level.blocks.resize(level.blocks_x * blocks_y);
+            for (int by = 0; by < blocks_y; by++)
+                for (int bx = 0; bx < level.blocks_x; bx++)
+                    level.blocks[by * level.blocks_x + bx] = encode_block(l, bx * 4, by * 4);
+            c->levels.push_back(std::move(level));
+        }
+        return c;
+    }
+
+    int levels_count() const override { return levels.size(); }
+    int level_width(int level) const override { return levels[level].width; }
+    int level_height(int level) const override { return levels[level].height; }
+
+    vec3 texel(int level, int x, int y) const override {
+        const compressed_level& l = levels[level];
+        const block& b = l.blocks[(y >> 2) * l.blocks_x + (x >> 2)];
+        int index = (b.indices >> (2 * ((y & 3) * 4 + (x & 3)))) & 3;
+        vec3 c0 = from_565(b.color0);
+        vec3 c1 = from_565(b.color1);
+        switch (index) {
+        case 0:
+            return c0;
+        case 1:
+            return c1;
+        case 2:
+            return (2 * c0 + c1) / 3;
+        default:
+            return (c0 + 2 * c1) / 3;
+        }
+    }
+
+    size_t size_in_bytes() const {
+        size_t n = 0;
+        for (const auto& l : levels)
+            n += l.blocks.size() * sizeof(block);
+        return n;
+    }
+
+private:
+    struct compressed_level {
+        int width, height;
+        int blocks_x;
+        std::vector<block> blocks;
+    };
+
+    static vec3 from_565(uint16_t c) {
+        return vec3(((c >> 11) & 31) / 31.0f, ((c >> 5) & 63) / 63.0f, (c & 31) / 31.0f);
+    }
+
+    static uint16_t to_565(const vec3& c) {
+        int r = std::clamp(int(c.r() * 31 + 0.5f), 0, 31);
+        int g = std::clamp(int(c.g() * 63 + 0.5f), 0, 63);
+        int b = std::clamp(int(c.b() * 31 + 0.5f), 0, 31);
+        return uint16_t(r << 11 | g << 5 | b);
+    }
+
+    // End points are the extremes of the block along its principal axis,
+    // then every texel takes the nearest of the four palette colors.
+    static block encode_block(const mip_level& l, int x0, int y0) {
+        vec3 colors[16];
+        vec3 mean(0, 0, 0);
+        for (int i = 0; i < 16; i++) {
+            int x = std::min(x0 + (i & 3), l.width - 1);
+            int y = std::min(y0 + (i >> 2), l.height - 1);
+            colors[i] = l.texel(x, y);
+            mean += colors[i];
+        }
+        mean /= 16;
+
+        float cov[6] = { 0, 0, 0, 0, 0, 0 };
+        for (const vec3& c : colors) {
+            vec3 d = c - mean;
+            cov[0] += d.x() * d.x();
+            cov[1] += d.x() * d.y();
+            cov[2] += d.x() * d.z();
+            cov[3] += d.y() * d.y();
+            cov[4] += d.y() * d.z();
+            cov[5] += d.z() * d.z();
+        }
+        // Power iteration for the principal axis, from the column of the
+        // channel that varies most. A fixed start like (1, 1, 1) can be
+        // orthogonal to the spread, as for a red and green checker.
+        vec3 axis = cov[0] >= cov[3] && cov[0] >= cov[5] ? vec3(cov[0], cov[1], cov[2])
+                  : cov[3] >= cov[5]                   ? vec3(cov[1], cov[3], cov[4])
+                                                       : vec3(cov[2], cov[4], cov[5]);
+        if (axis.length() < 1e-12)
+            axis = vec3(1, 1, 1);
+        axis /= axis.length();
+        for (int i = 0; i < 4; i++) {
+            vec3 next(cov[0] * axis.x() + cov[1] * axis.y() + cov[2] * axis.z(),
+                      cov[1] * axis.x() + cov[3] * axis.y() + cov[4] * axis.z(),
+                      cov[2] * axis.x() + cov[4] * axis.y() + cov[5] * axis.z());
+            float len = next.length();
+            // keep the last axis rather than a vanishing one
+            if (len < 1e-12)
+                break;
+            axis = next / len;
+        }
+        float lo = 0, hi = 0;
+        for (const vec3& c : colors) {
+            float t = dot(c - mean, axis);
+            lo = std::min(lo, t);
+            hi = std::max(hi, t);
+        }
+
+        block b;
+        b.color0 = to_565(mean + hi * axis);
+        b.color1 = to_565(mean + lo * axis);
+        // color0 > color1 selects the four color mode
+        if (b.color0 < b.color1)
+            std::swap(b.color0, b.color1);
+        b.indices = 0;
+        if (b.color0 == b.color1)
+            return b;
+        vec3 c0 = from_565(b.color0);
+        vec3 c1 = from_565(b.color1);
+        vec3 palette[4] = { c0, c1, (2 * c0 + c1) / 3, (c0 + 2 * c1) / 3 };
+        for (int i = 0; i < 16; i++) {
+            int best = 0;
+            float best_distance = dot(colors[i] - palette[0], colors[i] - palette[0]);
+            for (int p = 1; p < 4; p++) {
+                float distance = dot(colors[i] - palette[p], colors[i] - palette[p]);
+                if (distance < best_distance) {
+                    best = p;
+                    best_distance = distance;
+                }
+            }
+            b.indices |= uint32_t(best) << (2 * i);
+        }
+        return b;
+    }
+
+    std::vector<compressed_level> levels;
+};
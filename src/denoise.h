@@ -0,0 +1,245 @@
+#pragma once
+
+#include "hitable.h"
+#include "material.h"
+#include "ray.h"
+#include "vec3.h"
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+inline float luminance(const vec3& c)
+{
+    return 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2];
+}
+
+// Sums over the samples of one pixel: the color, and what the first hit of
+// each camera ray saw.
+struct pixel_sums {
+    vec3 color { 0, 0, 0 };
+    // of the squared luminance of the color, for its variance
+    float luminance2 = 0;
+    vec3 albedo { 0, 0, 0 };
+    vec3 normal { 0, 0, 0 };
+    float depth = 0;
+    // part of color the first hit emits itself
+    vec3 emitted { 0, 0, 0 };
+
+    void add_color(const vec3& c) {
+        color += c;
+        luminance2 += luminance(c) * luminance(c);
+    }
+
+    // hit is what camera ray r hit in world, or nullptr. Mirrors and glass
+    // are followed to what they show, tinted by them, or a flat mirror
+    // would blend everything seen in it. Rays that miss see the sky, white
+    // at depth far.
+    void add_first_hit(ray r, const hit_info* hit, const hitable* world, float far = 1e9) {
+        vec3 tint(1, 1, 1);
+        float distance = 0;
+        hit_info next;
+        for (int bounce = 0;; bounce++) {
+            if (!hit) {
+                albedo += tint;
+                depth += far;
+                return;
+            }
+            hit_record rec;
+            finish_hit(r, *hit, rec);
+            distance += rec.t * r.direction().length();
+            vec3 attenuation;
+            ray scattered;
+            if (bounce < 4 && rec.mat_ptr->specular()
+                && rec.mat_ptr->scatter(r, rec, attenuation, scattered)) {
+                tint *= attenuation;
+                r = scattered;
+                hit = world->hit(r, 0.001, 1e9, next) ? &next : nullptr;
+                continue;
+            }
+            albedo += tint * rec.mat_ptr->albedo_at(rec);
+            emitted += tint * rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+            normal += rec.normal;
+            depth += distance;
+            return;
+        }
+    }
+};
+
+// Per pixel buffers of a render, row j = 0 at the bottom: the linear color,
+// the variance of its luminance, and the auxiliary outputs (AOVs) of the
+// first hits, averaged over the samples.
+struct render_buffers {
+    int nx;
+    int ny;
+    std::vector<vec3> color;
+    std::vector<float> variance;
+    std::vector<vec3> albedo;
+    std::vector<vec3> normal;
+    std::vector<float> depth;
+    std::vector<vec3> emitted;
+
+    render_buffers(int w, int h)
+        : nx(w), ny(h), color(w * h), variance(w * h), albedo(w * h), normal(w * h), depth(w * h), emitted(w * h)
+    {
+    }
+
+    // Stores the means of n samples summed in sums at pixel (i, j).
+    void store(int i, int j, const pixel_sums& sums, int n) {
+        int p = i + nx * j;
+        color[p] = sums.color / float(n);
+        // of the mean, from the spread of the samples
+        float mean = luminance(color[p]);
+        variance[p] = n > 1 ? std::max(0.0f, sums.luminance2 / n - mean * mean) / (n - 1) : 0;
+        albedo[p] = sums.albedo / float(n);
+        normal[p] = sums.normal / float(n);
+        depth[p] = sums.depth / n;
+        emitted[p] = sums.emitted / float(n);
+    }
+};
+
+// Calls f(j) for every row, split between threads.
+template <typename F>
+void for_each_row(int ny, int threads, F f)
+{
+    std::vector<std::thread> workers;
+    for (int k = 0; k < threads; k++) {
+        workers.push_back(std::thread([k, ny, threads, &f]() {
+            for (int j = k; j < ny; j += threads)
+                f(j);
+        }));
+    }
+    for (auto& t : workers)
+        t.join();
+}
+
+// Edge-avoiding a-trous wavelet filter, after Dammertz et al., "Edge-Avoiding
+// A-Trous Wavelet Transform for fast Global Illumination Filtering". Each
+// pass blurs by a 5x5 B3 spline whose taps spread twice as far as the last
+// pass's, so five passes cover 61x61 pixels at the cost of 25 taps each.
+// Taps are weighted down across edges of the normal and depth AOVs, and by
+// how far their luminance is from the pixel's in units of noise, the
+// standard deviation of the difference from the variances, after Schied et
+// al.'s SVGF.
+//
+// The illumination is filtered, the color less what the first hits emit
+// divided by the albedo, and the albedo multiplied back after, so textures
+// stay sharp and lights do not bleed into what surrounds them.
+class atrous_denoiser {
+public:
+    int passes = 5;
+    // how many standard deviations of noise the luminance may differ by
+    float sigma_luminance = 2;
+    // exponent of the cosine between normals
+    float sigma_normal = 128;
+    // how many times the depth change the slope of the surface predicts
+    float sigma_depth = 1;
+
+    std::vector<vec3> denoise(const render_buffers& b, int threads = std::thread::hardware_concurrency()) const {
+        int nx = b.nx, ny = b.ny;
+        threads = std::max(threads, 1);
+        std::vector<vec3> light(nx * ny), next_light(nx * ny);
+        std::vector<float> variance(nx * ny), next_variance(nx * ny);
+        std::vector<float> depth_dx(nx * ny), depth_dy(nx * ny);
+        for_each_row(ny, threads, [&](int j) {
+            for (int i = 0; i < nx; i++) {
+                int p = i + nx * j;
+                vec3 a = demodulation(b.albedo[p]);
+                light[p] = (b.color[p] - b.emitted[p]) / a;
+                variance[p] = b.variance[p] / (luminance(a) * luminance(a));
+                int i0 = std::max(i - 1, 0), i1 = std::min(i + 1, nx - 1);
+                int j0 = std::max(j - 1, 0), j1 = std::min(j + 1, ny - 1);
+                // the smaller one sided difference, not the step of an edge
+                depth_dx[p] = std::min(std::fabs(b.depth[p] - b.depth[i0 + nx * j]), std::fabs(b.depth[i1 + nx * j] - b.depth[p]));
+                depth_dy[p] = std::min(std::fabs(b.depth[p] - b.depth[i + nx * j0]), std::fabs(b.depth[i + nx * j1] - b.depth[p]));
+            }
+        });
+
+        const float kernel[5] = { 1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+        for (int pass = 0; pass < passes; pass++) {
+            int step = 1 << pass;
+            for_each_row(ny, threads, [&](int j) {
+                for (int i = 0; i < nx; i++) {
+                    int p = i + nx * j;
+                    float variance_p = blurred_variance(variance, nx, ny, i, j);
+                    float l = luminance(light[p]);
+                    vec3 sum(0, 0, 0);
+                    float weights = 0;
+                    float variance_sum = 0;
+                    for (int dy = -2; dy <= 2; dy++) {
+                        int y = j + dy * step;
+                        if (y < 0 || y >= ny)
+                            continue;
+                        for (int dx = -2; dx <= 2; dx++) {
+                            int x = i + dx * step;
+                            if (x < 0 || x >= nx)
+                                continue;
+                            int q = x + nx * y;
+                            // q only shows lights, no light reflected
+                            if (q != p && max_component(b.albedo[q]) == 0)
+                                continue;
+                            float w = kernel[dx + 2] * kernel[dy + 2];
+                            if (q != p) {
+                                // of the difference, so a pixel that saw no
+                                // light still takes in its noisy neighbours
+                                float noise = std::sqrt(variance_p + variance[q]);
+                                w *= edge_weight(b, p, q, depth_dx[p] * std::abs(dx * step) + depth_dy[p] * std::abs(dy * step))
+                                   * std::exp(-std::fabs(luminance(light[q]) - l) / (sigma_luminance * noise + 1e-6f));
+                            }
+                            sum += w * light[q];
+                            weights += w;
+                            variance_sum += w * w * variance[q];
+                        }
+                    }
+                    next_light[p] = sum / weights;
+                    next_variance[p] = variance_sum / (weights * weights);
+                }
+            });
+            std::swap(light, next_light);
+            std::swap(variance, next_variance);
+        }
+
+        for (int p = 0; p < nx * ny; p++)
+            light[p] = light[p] * demodulation(b.albedo[p]) + b.emitted[p];
+        return light;
+    }
+
+private:
+    // albedo the color is divided by, kept off 0 for black surfaces
+    static vec3 demodulation(const vec3& albedo) {
+        return max(albedo, vec3(0.01f, 0.01f, 0.01f));
+    }
+
+    // 3x3 gaussian of the variance around (i, j), steadier than one pixel's
+    static float blurred_variance(const std::vector<float>& variance, int nx, int ny, int i, int j) {
+        const float kernel[3] = { 0.25f, 0.5f, 0.25f };
+        float sum = 0, weights = 0;
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                int x = i + dx, y = j + dy;
+                if (x < 0 || x >= nx || y < 0 || y >= ny)
+                    continue;
+                float w = kernel[dx + 1] * kernel[dy + 1];
+                sum += w * variance[x + nx * y];
+                weights += w;
+            }
+        }
+        return sum / weights;
+    }
+
+    // Weight of q against p from the normals and depths of their first hits,
+    // depth_change being what the surface at p lets the depth change by.
+    float edge_weight(const render_buffers& b, int p, int q, float depth_change) const {
+        const vec3& n_p = b.normal[p];
+        const vec3& n_q = b.normal[q];
+        float w = 1;
+        // both may be sky, without a normal, and pixels on edges average
+        // shorter ones
+        if (n_p.norm() > 0 && n_q.norm() > 0)
+            w = std::pow(std::max(0.0f, dot(unit_vector(n_p), unit_vector(n_q))), sigma_normal);
+        else if (n_p.norm() > 0 || n_q.norm() > 0)
+            w = 0;
+        return w * std::exp(-std::fabs(b.depth[p] - b.depth[q]) / (sigma_depth * depth_change + 1e-3f * b.depth[p]));
+    }
+};
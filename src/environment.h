@@ -0,0 +1,163 @@
+#pragma once
+
+#include "common.h"
+#include "image.h"
+#include "vec3.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Light arriving from infinitely far away, given by a latitude-longitude
+// HDR image around the scene. Directions map to the image like points on a
+// sphere do to its texture, see get_sphere_uv(), with row 0 at the top.
+//
+// Directions are sampled in proportion to the radiance of each texel times
+// the solid angle it covers, through an alias table over the texels, so a
+// sample costs O(1) whatever the resolution. A small bright sun then gets
+// most of the samples instead of being found by chance.
+class environment {
+public:
+    // rgb holds width x height texels of linear radiance, row by row from
+    // the top, scaled by scale.
+    environment(const float* rgb, int w, int h, float scale = 1) : width(w), height(h), texels(w * h) {
+        for (int i = 0; i < w * h; i++)
+            texels[i] = scale * vec3(rgb[3 * i], rgb[3 * i + 1], rgb[3 * i + 2]);
+        build_alias_table();
+    }
+
+    // Loads a .hdr file, or any other format stb_image reads, converted to
+    // linear by it. Returns nullptr if it could not be decoded.
+    static environment* load(const std::string& path, float scale = 1) {
+        int nx, ny, nn;
+        float* data = stbi_loadf(path.c_str(), &nx, &ny, &nn, 3);
+        if (!data) {
+            std::cerr << "Failed to open: " << path << std::endl;
+            return nullptr;
+        }
+        environment* env = new environment(data, nx, ny, scale);
+        stbi_image_free(data);
+        return env;
+    }
+
+    // Radiance arriving along -direction. Texels are constant over their
+    // area, like the density sample() picks them with: filtering would
+    // spread a sun into texels rarely sampled and make fireflies there.
+    vec3 radiance(const vec3& direction) const {
+        return texels[texel_index(unit_vector(direction))];
+    }
+
+    // Picks a direction toward the sky with u1, u2, u3 uniform in [0, 1).
+    // Returns false if the whole map is black. pdf is per solid angle.
+    bool sample(float u1, float u2, float u3, vec3& direction, float& pdf) const {
+        if (texel_pmf.empty())
+            return false;
+        int n = width * height;
+        int i = std::min(int(u1 * n), n - 1);
+        // u2 decides between the texel and its alias, not the rest of u1:
+        // at 2^19 texels u1 * n has few bits left below the point. The
+        // part of u2 taken is stretched back over [0, 1) for the position
+        // in the texel.
+        if (u2 < threshold[i]) {
+            u2 /= threshold[i];
+        } else {
+            u2 = (u2 - threshold[i]) / (1 - threshold[i]);
+            i = alias[i];
+        }
+        u2 = std::min(u2, std::nextafter(1.0f, 0.0f));
+        float u = (i % width + u2) / width;
+        float v = 1 - (i / width + u3) / height;
+        float phi = (1 - u) * float(2 * M_PI) - float(M_PI);
+        float theta = v * float(M_PI) - float(M_PI / 2);
+        float cos_theta = cos(theta);
+        if (cos_theta <= 0)
+            return false;
+        direction = vec3(cos_theta * cos(phi), sin(theta), cos_theta * sin(phi));
+        pdf = texel_pmf[i] * n / (float(2 * M_PI * M_PI) * cos_theta);
+        return true;
+    }
+
+    // Density of sample() picking direction, per solid angle.
+    float pdf(const vec3& direction) const {
+        if (texel_pmf.empty())
+            return 0;
+        vec3 d = unit_vector(direction);
+        float cos_theta = std::sqrt(std::max(0.0f, 1 - d.y() * d.y()));
+        if (cos_theta <= 0)
+            return 0;
+        return texel_pmf[texel_index(d)] * width * height / (float(2 * M_PI * M_PI) * cos_theta);
+    }
+
+    int width;
+    int height;
+
+private:
+    const vec3& texel(int x, int y) const { return texels[x + y * width]; }
+
+    // texel seen in unit direction d
+    int texel_index(const vec3& d) const {
+        float u, v;
+        get_sphere_uv(d, u, v);
+        int x = std::clamp(int(u * width), 0, width - 1);
+        int y = std::clamp(int((1 - v) * height), 0, height - 1);
+        return x + y * width;
+    }
+
+    // Vose's alias method over texel luminance times the solid angle of the
+    // texel's row.
+    void build_alias_table() {
+        int n = width * height;
+        std::vector<double> weight(n);
+        double total = 0;
+        for (int y = 0; y < height; y++) {
+            float solid_angle = sin(M_PI * (y + 0.5) / height);
+            for (int x = 0; x < width; x++) {
+                const vec3& c = texel(x, y);
+                float luminance = 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2];
+                weight[x + y * width] = std::max(luminance, 0.0f) * solid_angle;
+                total += weight[x + y * width];
+            }
+        }
+        if (!(total > 0))
+            return;
+
+        texel_pmf.resize(n);
+        threshold.resize(n);
+        alias.resize(n);
+        std::vector<int> small, large;
+        std::vector<double> scaled(n);
+        for (int i = 0; i < n; i++) {
+            texel_pmf[i] = weight[i] / total;
+            scaled[i] = weight[i] / total * n;
+            alias[i] = i;
+            (scaled[i] < 1 ? small : large).push_back(i);
+        }
+        while (!small.empty() && !large.empty()) {
+            int s = small.back();
+            small.pop_back();
+            int l = large.back();
+            threshold[s] = scaled[s];
+            alias[s] = l;
+            scaled[l] -= 1 - scaled[s];
+            if (scaled[l] < 1) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+        // left over by rounding, taken whole
+        for (int i : small)
+            threshold[i] = 1;
+        for (int i : large)
+            threshold[i] = 1;
+    }
+
+    std::vector<vec3> texels;
+    // probability of picking each texel
+    std::vector<float> texel_pmf;
+    // a texel is kept with probability threshold and gives way to alias
+    // otherwise
+    std::vector<float> threshold;
+    std::vector<int> alias;
+};
@@ -0,0 +1,233 @@
+#pragma once
+
+#include "aabb.h"
+#include "vec3.h"
+
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Values of a function sampled at the points of a regular grid spanning a
+// box, looked up trilinearly. Used to bake static procedural textures.
+template <typename T>
+class grid3 {
+public:
+    // resolution is the number of samples along each axis, at least 2
+    grid3(const aabb& b, int res)
+        : box(b)
+        , resolution(std::max(2, res))
+        , values(size_t(resolution) * resolution * resolution)
+    {
+    }
+
+    vec3 point(int i, int j, int k) const {
+        vec3 f(float(i) / (resolution - 1), float(j) / (resolution - 1), float(k) / (resolution - 1));
+        return box.min() + f * (box.max() - box.min());
+    }
+
+    // Stores f(point) at every grid point. Slices are split between threads,
+    // so f must be safe to call concurrently.
+    template <typename F>
+    void fill(F f) {
+        int n = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<std::thread> threads;
+        for (int t = 0; t < n; t++) {
+            threads.push_back(std::thread([this, &f, t, n]() {
+                for (int k = t; k < resolution; k += n)
+                    for (int j = 0; j < resolution; j++)
+                        for (int i = 0; i < resolution; i++)
+                            values[index(i, j, k)] = f(point(i, j, k));
+            }));
+        }
+        for (auto& t : threads)
+            t.join();
+    }
+
+    // Returns false if p is outside the box.
+    bool lookup(const vec3& p, T& out) const {
+        float f[3];
+        int i[3];
+        for (int a = 0; a < 3; a++) {
+            float extent = box.max()[a] - box.min()[a];
+            float x = extent > 0 ? (p[a] - box.min()[a]) / extent * (resolution - 1) : 0;
+            if (x < 0 || x > resolution - 1)
+                return false;
+            i[a] = std::min(int(x), resolution - 2);
+            f[a] = x - i[a];
+        }
+        T c00 = (1 - f[0]) * values[index(i[0], i[1], i[2])] + f[0] * values[index(i[0] + 1, i[1], i[2])];
+        T c10 = (1 - f[0]) * values[index(i[0], i[1] + 1, i[2])] + f[0] * values[index(i[0] + 1, i[1] + 1, i[2])];
+        T c01 = (1 - f[0]) * values[index(i[0], i[1], i[2] + 1)] + f[0] * values[index(i[0] + 1, i[1], i[2] + 1)];
+        T c11 = (1 - f[0]) * values[index(i[0], i[1] + 1, i[2] + 1)] + f[0] * values[index(i[0] + 1, i[1] + 1, i[2] + 1)];
+        out = (1 - f[2]) * ((1 - f[1]) * c00 + f[1] * c10) + f[2] * ((1 - f[1]) * c01 + f[1] * c11);
+        return true;
+    }
+
+    aabb box;
+    int resolution;
+    std::vector<T> values;
+
+private:
+    size_t index(int i, int j, int k) const {
+        return (size_t(k) * resolution + j) * resolution + i;
+    }
+};
+
+// Sparse grid of densities for heterogeneous media. Voxels are stored in
+// bricks of brick_size^3 and bricks where the density is zero everywhere
+// are not stored, so memory follows the occupied volume. Each brick keeps a
+// majorant, the largest density that lookups inside it can return, for
+// tracking to skip empty bricks and bound the others tightly.
+class brick_grid {
+public:
+    static const int brick_size = 8;
+
+    // resolution is the number of voxels along each axis, rounded up to
+    // whole bricks
+    brick_grid(const aabb& b, int res)
+        : box(b)
+        , occupied(b.min(), b.min())
+        , bricks((std::max(1, res) + brick_size - 1) / brick_size)
+        , resolution(bricks * brick_size)
+        , brick_index(size_t(bricks) * bricks * bricks, -1)
+        , majorants(brick_index.size(), 0)
+    {
+    }
+
+    vec3 voxel_center(int i, int j, int k) const {
+        vec3 f((i + 0.5f) / resolution, (j + 0.5f) / resolution, (k + 0.5f) / resolution);
+        return box.min() + f * (box.max() - box.min());
+    }
+
+    // Stores f at every voxel center, f >= 0. Slabs of bricks are split
+    // between threads, so f must be safe to call concurrently.
+    template <typename F>
+    void fill(F f) {
+        const int n3 = brick_size * brick_size * brick_size;
+        std::fill(brick_index.begin(), brick_index.end(), -1);
+        voxels.clear();
+        std::mutex mutex;
+        int n = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<std::thread> threads;
+        for (int t = 0; t < n; t++) {
+            threads.push_back(std::thread([this, &f, &mutex, t, n, n3]() {
+                std::vector<float> values(n3);
+                for (int bk = t; bk < bricks; bk += n) {
+                    for (int bj = 0; bj < bricks; bj++) {
+                        for (int bi = 0; bi < bricks; bi++) {
+                            bool occupied = false;
+                            for (int v = 0; v < n3; v++) {
+                                int i = bi * brick_size + v % brick_size;
+                                int j = bj * brick_size + v / brick_size % brick_size;
+                                int k = bk * brick_size + v / (brick_size * brick_size);
+                                values[v] = f(voxel_center(i, j, k));
+                                occupied |= values[v] > 0;
+                            }
+                            if (!occupied)
+                                continue;
+                            std::lock_guard<std::mutex> lock(mutex);
+                            brick_index[brick(bi, bj, bk)] = voxels.size() / n3;
+                            voxels.insert(voxels.end(), values.begin(), values.end());
+                        }
+                    }
+                }
+            }));
+        }
+        for (auto& t : threads)
+            t.join();
+
+        // Lookups in a brick interpolate voxels up to one beyond its faces.
+        int lo[3] = { bricks, bricks, bricks };
+        int hi[3] = { -1, -1, -1 };
+        for (int bk = 0; bk < bricks; bk++) {
+            for (int bj = 0; bj < bricks; bj++) {
+                for (int bi = 0; bi < bricks; bi++) {
+                    float m = 0;
+                    for (int k = bk * brick_size - 1; k <= (bk + 1) * brick_size; k++)
+                        for (int j = bj * brick_size - 1; j <= (bj + 1) * brick_size; j++)
+                            for (int i = bi * brick_size - 1; i <= (bi + 1) * brick_size; i++)
+                                m = std::max(m, voxel(i, j, k));
+                    majorants[brick(bi, bj, bk)] = m;
+                    if (m > 0) {
+                        int b[3] = { bi, bj, bk };
+                        for (int a = 0; a < 3; a++) {
+                            lo[a] = std::min(lo[a], b[a]);
+                            hi[a] = std::max(hi[a], b[a]);
+                        }
+                    }
+                }
+            }
+        }
+        if (hi[0] < 0) {
+            occupied = aabb(box.min(), box.min());
+        } else {
+            vec3 brick_extent = (box.max() - box.min()) / float(bricks);
+            occupied = aabb(box.min() + vec3(lo[0], lo[1], lo[2]) * brick_extent,
+                            box.min() + vec3(hi[0] + 1, hi[1] + 1, hi[2] + 1) * brick_extent);
+        }
+    }
+
+    // Trilinear between voxel centers, 0 outside the box.
+    float density(const vec3& p) const {
+        float f[3];
+        int i[3];
+        for (int a = 0; a < 3; a++) {
+            float x = (p[a] - box.min()[a]) / (box.max()[a] - box.min()[a]) * resolution - 0.5f;
+            float fl = std::floor(x);
+            i[a] = int(fl);
+            f[a] = x - fl;
+        }
+        float c00 = (1 - f[0]) * voxel(i[0], i[1], i[2]) + f[0] * voxel(i[0] + 1, i[1], i[2]);
+        float c10 = (1 - f[0]) * voxel(i[0], i[1] + 1, i[2]) + f[0] * voxel(i[0] + 1, i[1] + 1, i[2]);
+        float c01 = (1 - f[0]) * voxel(i[0], i[1], i[2] + 1) + f[0] * voxel(i[0] + 1, i[1], i[2] + 1);
+        float c11 = (1 - f[0]) * voxel(i[0], i[1] + 1, i[2] + 1) + f[0] * voxel(i[0] + 1, i[1] + 1, i[2] + 1);
+        return (1 - f[2]) * ((1 - f[1]) * c00 + f[1] * c10) + f[2] * ((1 - f[1]) * c01 + f[1] * c11);
+    }
+
+    float majorant(int bi, int bj, int bk) const {
+        return majorants[brick(bi, bj, bk)];
+    }
+
+    // Largest density anywhere.
+    float max_majorant() const {
+        return *std::max_element(majorants.begin(), majorants.end());
+    }
+
+    int stored_bricks() const {
+        return voxels.size() / (brick_size * brick_size * brick_size);
+    }
+
+    size_t size_in_bytes() const {
+        return voxels.size() * sizeof(float) + brick_index.size() * sizeof(int) + majorants.size() * sizeof(float);
+    }
+
+    aabb box;
+    // bounds of the bricks with a nonzero majorant, set by fill()
+    aabb occupied;
+    // bricks along each axis
+    int bricks;
+    // voxels along each axis
+    int resolution;
+
+private:
+    size_t brick(int bi, int bj, int bk) const {
+        return (size_t(bk) * bricks + bj) * bricks + bi;
+    }
+
+    // 0 outside the grid and in empty bricks
+    float voxel(int i, int j, int k) const {
+        if (i < 0 || j < 0 || k < 0 || i >= resolution || j >= resolution || k >= resolution)
+            return 0;
+        int b = brick_index[brick(i / brick_size, j / brick_size, k / brick_size)];
+        if (b < 0)
+            return 0;
+        int v = (k % brick_size * brick_size + j % brick_size) * brick_size + i % brick_size;
+        return voxels[size_t(b) * brick_size * brick_size * brick_size + v];
+    }
+
+    std::vector<int> brick_index;
+    std::vector<float> majorants;
+    std::vector<float> voxels;
+};
@@ -1,57 +1,242 @@
 #pragma once
 
 #include "aabb.h"
+#include "matrix.h"
 #include "ray.h"
 
 #include <algorithm>
+#include <cstdlib>
+#include <iostream>
 #include <limits>
+#include <vector>
 
+class hitable;
 class material;
 
-struct hit_record {
+// What traversal keeps of the closest hit so far. The shading record is only
+// evaluated for the final hit, see finish_hit().
+struct hit_info {
     float t;
+    // primitive specific parametric coordinates, e.g. barycentrics
+    float u = 0;
+    float v = 0;
+    // wrappers between obj and the primitive, see wrap_hit()
+    int wrappers = 0;
+    // object whose surface() evaluates this hit
+    const hitable* obj = nullptr;
+    // for wrappers, the objects below them which reported the hit, the
+    // innermost first
+    static const int max_wrappers = 4;
+    const hitable* inner[max_wrappers];
+};
+
+// Ordered so that it fits in 64 bytes.
+struct hit_record {
     vec3 p;
     vec3 normal;
     material *mat_ptr;
+    float t;
     // texture coordinates
     float u = 0;
     float v = 0;
+    // change of texture coordinates per world unit, 0 if unknown
+    float uv_scale = 0;
+    // width of the ray footprint in texture coordinates
+    float footprint = 0;
+};
+
+// Emitted radiance of mat at texture coordinates u, v of p, defined in
+// material.h.
+vec3 emission(const material* mat, float u, float v, const vec3& p);
+
+// A triangle of an emissive surface in world space, for sampling lights.
+struct emitter {
+    vec3 v0, v1, v2;
+    // radiance at the centroid, to estimate the power
+    vec3 radiance;
+    // otherwise seen only from the side of normal(), like triangle
+    bool two_sided;
+    // the primitive, and the object its hits name in hit_info::obj
+    const hitable* prim;
+    const hitable* obj;
+
+    vec3 normal() const { return unit_vector(cross(v1 - v0, v2 - v0)); }
+    float area() const { return cross(v1 - v0, v2 - v0).length() / 2; }
+    // smallest barycentric coordinate of p projected to the plane, negative
+    // outside the triangle
+    float inside(const vec3& p) const {
+        vec3 n = cross(v1 - v0, v2 - v0);
+        float b0 = dot(cross(v1 - p, v2 - p), n);
+        float b1 = dot(cross(v2 - p, v0 - p), n);
+        float b2 = n.norm() - b0 - b1;
+        return std::min({ b0, b1, b2 }) / n.norm();
+    }
+    // uniformly distributed for u1, u2 uniform in [0, 1)
+    vec3 point(float u1, float u2) const {
+        float s = sqrt(u1);
+        return (1 - s) * v0 + (u2 * s) * v1 + ((1 - u2) * s) * v2;
+    }
 };
 
 class hitable {
 public:
-    virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const = 0;
+    virtual ~hitable() { }
+    // Reports the closest hit in (t_min, t_max). Writes hit only when it
+    // returns true.
+    virtual bool hit(const ray& r, float t_min, float t_max, hit_info& hit) const = 0;
     virtual bool bounding_box(float t0, float t1, aabb& box) const = 0;
+    // Computes p, normal, mat_ptr and texture coordinates of a hit this
+    // object reported. Objects which report hits must override it.
+    virtual void surface(const ray&, const hit_info&, hit_record&) const {
+        std::cerr << "hitable::surface called on an object without surfaces!" << std::endl;
+        std::abort();
+    }
+    // Point of the surface with texture coordinates u, v. Returns false if
+    // the object has no single parameterization to invert.
+    virtual bool point_at_uv(float, float, vec3&) const { return false; }
+    // Finds where r enters the object and leaves it again, clipped to
+    // (t_min, t_max). Returns false if that is empty. Exact for convex
+    // objects; this generic version finds the first two hits along the
+    // whole line, like the boundary of constant_medium always did.
+    virtual bool hit_interval(const ray& r, float t_min, float t_max, float& t_enter, float& t_exit) const;
+    // Appends the emissive surfaces of the object as triangles. Objects
+    // which cannot, like spheres, add nothing and are only lit by rays
+    // hitting them.
+    virtual void emitters(std::vector<emitter>&) const { }
 };
 
+bool hitable::hit_interval(const ray& r, float t_min, float t_max, float& t_enter, float& t_exit) const
+{
+    aabb box;
+    if (bounding_box(0, 1, box) && !box.hit(r, t_min, t_max))
+        return false;
+    hit_info first, second;
+    if (!hit(r, std::numeric_limits<float>::lowest(), std::numeric_limits<float>::max(), first))
+        return false;
+    if (!hit(r, first.t + 0.0001f, std::numeric_limits<float>::max(), second))
+        return false;
+    t_enter = std::max(first.t, t_min);
+    t_exit = std::min(second.t, t_max);
+    return t_enter < t_exit;
+}
+
+// Evaluates the shading record of hit.
+inline void finish_hit(const ray& r, const hit_info& hit, hit_record& rec)
+{
+    rec.t = hit.t;
+    rec.uv_scale = 0;
+    hit.obj->surface(r, hit, rec);
+    rec.footprint = 0;
+    if (rec.uv_scale > 0) {
+        // The footprint stretches by 1 / cos at grazing angles. Filtering
+        // is isotropic, so use the longer axis.
+        float cosine = fabs(dot(unit_vector(r.direction()), rec.normal));
+        rec.footprint = r.footprint(rec.t) * rec.uv_scale / std::max(cosine, 0.05f);
+    }
+}
+
+// Wrappers report the hits of their inner object as their own, keeping the
+// inner reporter in hit.inner, so traversal never evaluates a surface.
+// Primitives reporting a hit set hit.wrappers to 0.
+inline void wrap_hit(hit_info& hit, const hitable* wrapper)
+{
+    if (hit.wrappers < hit_info::max_wrappers)
+        hit.inner[hit.wrappers++] = hit.obj;
+    else
+        // too deep to keep: from here out, inner_hit() finds it again
+        hit.wrappers = 0;
+    hit.obj = wrapper;
+}
+
+// Returns the inner hit of a hit wrap_hit() made ptr's wrapper's, for the
+// wrapper's surface(). Below max_wrappers nested wrappers that is the
+// reporter it kept. Deeper ones find the hit again in a small interval
+// around t, wider if rounding moved it out. A stochastic medium may not
+// show it again, then ptr evaluates the hit at t itself.
+inline hit_info inner_hit(const hitable* ptr, const ray& r, const hit_info& hit)
+{
+    hit_info h = hit;
+    if (h.wrappers > 0) {
+        h.obj = h.inner[--h.wrappers];
+        return h;
+    }
+    float eps = 1e-4f * (1 + fabs(hit.t));
+    for (int i = 0; i < 2; i++, eps *= 64) {
+        if (ptr->hit(r, hit.t - eps, hit.t + eps, h))
+            return h;
+    }
+    h = hit;
+    h.obj = ptr;
+    return h;
+}
+
+// Emitters out[first, end) of a wrapper's inner object, moved to the
+// wrapper's space by to_outer(point) and named by the wrapper.
+template <typename F>
+void wrap_emitters(std::vector<emitter>& out, size_t first, const hitable* obj, F to_outer)
+{
+    for (size_t k = first; k < out.size(); k++) {
+        out[k].v0 = to_outer(out[k].v0);
+        out[k].v1 = to_outer(out[k].v1);
+        out[k].v2 = to_outer(out[k].v2);
+        out[k].obj = obj;
+    }
+}
+
 class flip_normals : public hitable {
 public:
     flip_normals(hitable* p) : ptr(p) { }
-    bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
-        if (ptr->hit(r, t_min, t_max, rec)) {
-            rec.normal = -rec.normal;
+    bool hit(const ray& r, float t_min, float t_max, hit_info& hit) const {
+        if (ptr->hit(r, t_min, t_max, hit)) {
+            wrap_hit(hit, this);
             return true;
         }
         return false;
     }
+    void surface(const ray& r, const hit_info& hit, hit_record& rec) const {
+        finish_hit(r, inner_hit(ptr, r, hit), rec);
+        rec.normal = -rec.normal;
+    }
     bool bounding_box(float t0, float t1, aabb& box) const {
         return ptr->bounding_box(t0, t1, box);
     }
+    bool point_at_uv(float u, float v, vec3& p) const {
+        return ptr->point_at_uv(u, v, p);
+    }
+    bool hit_interval(const ray& r, float t_min, float t_max, float& t_enter, float& t_exit) const {
+        return ptr->hit_interval(r, t_min, t_max, t_enter, t_exit);
+    }
+    // only the normal flips, emission does not depend on it
+    void emitters(std::vector<emitter>& out) const {
+        size_t first = out.size();
+        ptr->emitters(out);
+        wrap_emitters(out, first, this, [](const vec3& p) { return p; });
+    }
     hitable* ptr;
 };
 
 class translate : public hitable {
 public:
     translate(hitable* p, const vec3& displacement) : ptr(p), offset(displacement) { }
-    bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
-        ray moved(r.origin() - offset, r.direction(), r.time());
-        if (ptr->hit(moved, t_min, t_max, rec)) {
-            rec.p += offset;
+    bool hit(const ray& r, float t_min, float t_max, hit_info& hit) const {
+        ray moved = r.transformed(r.origin() - offset, r.direction());
+        if (ptr->hit(moved, t_min, t_max, hit)) {
+            wrap_hit(hit, this);
             return true;
         }
         return false;
     }
 
+    void surface(const ray& r, const hit_info& hit, hit_record& rec) const {
+        ray moved = r.transformed(r.origin() - offset, r.direction());
+        finish_hit(moved, inner_hit(ptr, moved, hit), rec);
+        rec.p += offset;
+    }
+
+    bool hit_interval(const ray& r, float t_min, float t_max, float& t_enter, float& t_exit) const {
+        return ptr->hit_interval(r.transformed(r.origin() - offset, r.direction()), t_min, t_max, t_enter, t_exit);
+    }
+
     bool bounding_box(float t0, float t1, aabb& box) const {
         if (ptr->bounding_box(t0, t1, box)) {
             box = aabb(box.min() + offset, box.max() + offset);
@@ -60,6 +245,20 @@ public:
         return false;
     }
 
+    bool point_at_uv(float u, float v, vec3& p) const {
+        if (ptr->point_at_uv(u, v, p)) {
+            p += offset;
+            return true;
+        }
+        return false;
+    }
+
+    void emitters(std::vector<emitter>& out) const {
+        size_t first = out.size();
+        ptr->emitters(out);
+        wrap_emitters(out, first, this, [this](const vec3& p) { return p + offset; });
+    }
+
     hitable* ptr;
     vec3 offset;
 };
@@ -98,26 +297,39 @@ public:
         }
     }
 
-    bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    bool hit(const ray& r, float t_min, float t_max, hit_info& hit) const {
+        if (ptr->hit(rotated(r), t_min, t_max, hit)) {
+            wrap_hit(hit, this);
+            return true;
+        }
+        return false;
+    }
+
+    void surface(const ray& r, const hit_info& hit, hit_record& rec) const {
+        ray rotated_r = rotated(r);
+        finish_hit(rotated_r, inner_hit(ptr, rotated_r, hit), rec);
+        vec3 p = rec.p;
+        vec3 normal = rec.normal;
+        p[0] = cos_minus_theta * rec.p[0] - sin_minus_theta * rec.p[2];
+        p[2] = sin_minus_theta * rec.p[0] + cos_minus_theta * rec.p[2];
+        normal[0] = cos_minus_theta * rec.normal[0] - sin_minus_theta * rec.normal[2];
+        normal[2] = sin_minus_theta * rec.normal[0] + cos_minus_theta * rec.normal[2];
+        rec.p = p;
+        rec.normal = normal;
+    }
+
+    bool hit_interval(const ray& r, float t_min, float t_max, float& t_enter, float& t_exit) const {
+        return ptr->hit_interval(rotated(r), t_min, t_max, t_enter, t_exit);
+    }
+
+    ray rotated(const ray& r) const {
         vec3 origin = r.origin();
         vec3 direction = r.direction();
         origin[0] = cos_theta * r.origin()[0] - sin_theta * r.origin()[2];
         origin[2] = sin_theta * r.origin()[0] + cos_theta * r.origin()[2];
         direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
         direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
-        ray rotated_r(origin, direction, r.time());
-        if (ptr->hit(rotated_r, t_min, t_max, rec)) {
-            vec3 p = rec.p;
-            vec3 normal = rec.normal;
-            p[0] = cos_minus_theta * rec.p[0] - sin_minus_theta * rec.p[2];
-            p[2] = sin_minus_theta * rec.p[0] + cos_minus_theta * rec.p[2];
-            normal[0] = cos_minus_theta * rec.normal[0] - sin_minus_theta * rec.normal[2];
-            normal[2] = sin_minus_theta * rec.normal[0] + cos_minus_theta * rec.normal[2];
-            rec.p = p;
-            rec.normal = normal;
-            return true;
-        }
-        return false;
+        return r.transformed(origin, direction);
     }
 
     bool bounding_box(float t0, float t1, aabb& box) const {
@@ -125,6 +337,24 @@ public:
         return hasbox;
     }
 
+    bool point_at_uv(float u, float v, vec3& p) const {
+        vec3 q;
+        if (!ptr->point_at_uv(u, v, q))
+            return false;
+        p = q;
+        p[0] = cos_minus_theta * q[0] - sin_minus_theta * q[2];
+        p[2] = sin_minus_theta * q[0] + cos_minus_theta * q[2];
+        return true;
+    }
+
+    void emitters(std::vector<emitter>& out) const {
+        size_t first = out.size();
+        ptr->emitters(out);
+        wrap_emitters(out, first, this, [this](const vec3& q) {
+            return vec3(cos_minus_theta * q[0] - sin_minus_theta * q[2], q[1], sin_minus_theta * q[0] + cos_minus_theta * q[2]);
+        });
+    }
+
     float sin_theta;
     float cos_theta;
     float sin_minus_theta;
@@ -135,3 +365,91 @@ public:
     bool hasbox;
     aabb bbox;
 };
+
+// Places a shared object (typically a bvh_node over a mesh) with an affine
+// transform. Many instances may reference the same ptr, so memory grows with
+// unique geometry only; put the instances in a bvh_node as top level.
+class instance : public hitable {
+public:
+    instance(hitable* p, const mat34& transform)
+        : ptr(p)
+        , object_to_world(transform)
+        , world_to_object(transform.inverse())
+    {
+        aabb b;
+        hasbox = ptr->bounding_box(0, 1, b);
+        if (hasbox) {
+            vec3 minv(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+            vec3 maxv(std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest());
+            for (int i = 0; i < 8; i++) {
+                vec3 corner(i & 1 ? b.max().x() : b.min().x(),
+                            i & 2 ? b.max().y() : b.min().y(),
+                            i & 4 ? b.max().z() : b.min().z());
+                vec3 q = object_to_world.point(corner);
+                for (int c = 0; c < 3; c++) {
+                    minv[c] = std::min(minv[c], q[c]);
+                    maxv[c] = std::max(maxv[c], q[c]);
+                }
+            }
+            bbox = aabb(minv, maxv);
+        }
+    }
+
+    bool hit(const ray& r, float t_min, float t_max, hit_info& hit) const {
+        if (ptr->hit(local(r), t_min, t_max, hit)) {
+            wrap_hit(hit, this);
+            return true;
+        }
+        return false;
+    }
+
+    void surface(const ray& r, const hit_info& hit, hit_record& rec) const {
+        ray l = local(r);
+        finish_hit(l, inner_hit(ptr, l, hit), rec);
+        rec.p = object_to_world.point(rec.p);
+        rec.normal = unit_vector(world_to_object.transposed_vector(rec.normal));
+    }
+
+    bool hit_interval(const ray& r, float t_min, float t_max, float& t_enter, float& t_exit) const {
+        return ptr->hit_interval(local(r), t_min, t_max, t_enter, t_exit);
+    }
+
+    // direction is not normalized, so t is the same in both spaces
+    ray local(const ray& r) const {
+        return r.transformed(world_to_object.point(r.origin()), world_to_object.vector(r.direction()));
+    }
+
+    bool bounding_box(float t0, float t1, aabb& box) const {
+        box = bbox;
+        return hasbox;
+    }
+
+    bool point_at_uv(float u, float v, vec3& p) const {
+        vec3 q;
+        if (!ptr->point_at_uv(u, v, q))
+            return false;
+        p = object_to_world.point(q);
+        return true;
+    }
+
+    void emitters(std::vector<emitter>& out) const {
+        size_t first = out.size();
+        ptr->emitters(out);
+        wrap_emitters(out, first, this, [this](const vec3& p) { return object_to_world.point(p); });
+        // a mirroring transform turns the winding, and normal(), around
+        vec3 x = object_to_world.vector(vec3(1, 0, 0));
+        vec3 y = object_to_world.vector(vec3(0, 1, 0));
+        vec3 z = object_to_world.vector(vec3(0, 0, 1));
+        if (dot(x, cross(y, z)) < 0) {
+            for (size_t k = first; k < out.size(); k++)
+                std::swap(out[k].v1, out[k].v2);
+        }
+    }
+
+    hitable* ptr;
+    mat34 object_to_world;
+    mat34 world_to_object;
+
+    bool hasbox;
+    aabb bbox;
+};
@@ -7,22 +7,24 @@ class hitable_list: public hitable {
 public:
     hitable_list() {}
     hitable_list(hitable **l, int n) : list(l), list_size(n) { }
-    bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+    bool hit(const ray& r, float t_min, float t_max, hit_info& hit) const override;
     bool bounding_box(float t0, float t1, aabb& box) const override;
+    void emitters(std::vector<emitter>& out) const override {
+        for (int i = 0; i < list_size; i++)
+            list[i]->emitters(out);
+    }
     hitable** list;
     int list_size;
 };
 
-bool hitable_list::hit(const ray& r, float t_min, float t_max, hit_record& rec) const
+bool hitable_list::hit(const ray& r, float t_min, float t_max, hit_info& hit) const
 {
-    hit_record temp_rec;
     bool hit_anything = false;
-    double closest_so_far = t_max;
+    float closest_so_far = t_max;
     for(int i=0; i<list_size; i++) {
-        if(list[i]->hit(r, t_min, closest_so_far, temp_rec)) {
+        if(list[i]->hit(r, t_min, closest_so_far, hit)) {
             hit_anything = true;
-            closest_so_far = temp_rec.t;
-            rec = temp_rec;
+            closest_so_far = hit.t;
         }
     }
     return hit_anything;
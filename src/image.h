@@ -0,0 +1,150 @@
+#pragma once
+
+#include "vec3.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+// One RGBA8 level of an image. Texels are grouped in 4x4 blocks, one cache
+// line each, and the blocks of every 32x32 tile are stored in Morton order,
+// so texels close in both directions are close in memory. Tiles are stored
+// row by row, and the level is padded to whole tiles.
+struct mip_level {
+    static constexpr int tile_size = 32;
+
+    int width { 0 };
+    int height { 0 };
+    int tiles_x { 0 };
+    std::vector<unsigned char> pixels;
+
+    mip_level() { }
+    mip_level(int w, int h)
+        : width(w)
+        , height(h)
+        , tiles_x((w + tile_size - 1) / tile_size)
+        , pixels(size_t(4) * tiles_x * tile_size * ((h + tile_size - 1) / tile_size) * tile_size)
+    {
+    }
+
+    // Spreads the 3 bits of v to even positions.
+    static int spread_bits(int v) {
+        return (v & 1) | (v & 2) << 1 | (v & 4) << 2;
+    }
+
+    // Index of texel (x, y) inside its tile, the tile's own corner
+    // (x, y) = (0, 0). Shared with the tiles of tiled_image files.
+    static int offset_in_tile(int x, int y) {
+        int block = spread_bits((x >> 2) & 7) | spread_bits((y >> 2) & 7) << 1;
+        return block * 16 + (y & 3) * 4 + (x & 3);
+    }
+
+    size_t offset(int x, int y) const {
+        size_t tile = size_t(y / tile_size) * tiles_x + x / tile_size;
+        return 4 * (tile * tile_size * tile_size + offset_in_tile(x, y));
+    }
+
+    unsigned char* rgba(int x, int y) { return &pixels[offset(x, y)]; }
+    const unsigned char* rgba(int x, int y) const { return &pixels[offset(x, y)]; }
+
+    vec3 texel(int x, int y) const {
+        const unsigned char* p = rgba(x, y);
+        return vec3(p[0] / 255.0f, p[1] / 255.0f, p[2] / 255.0f);
+    }
+};
+
+// Image with a mip pyramid, level 0 being the full resolution and each
+// further level halving it down to 1x1. Subclasses decide where the texels
+// live, filtering is shared.
+class mipmapped_image {
+public:
+    virtual ~mipmapped_image() { }
+
+    virtual int levels_count() const = 0;
+    virtual int level_width(int level) const = 0;
+    virtual int level_height(int level) const = 0;
+    virtual vec3 texel(int level, int x, int y) const = 0;
+
+    int width() const { return level_width(0); }
+    int height() const { return level_height(0); }
+
+    // Bilinear lookup in one level. v = 0 is the bottom row, and
+    // coordinates outside [0, 1] are clamped.
+    vec3 bilinear(int level, float u, float v) const {
+        int w = level_width(level);
+        int h = level_height(level);
+        float fx = u * w - 0.5f;
+        float fy = (1 - v) * h - 0.5f;
+        int x0 = int(std::floor(fx));
+        int y0 = int(std::floor(fy));
+        float ax = fx - x0;
+        float ay = fy - y0;
+        int x1 = std::clamp(x0 + 1, 0, w - 1);
+        int y1 = std::clamp(y0 + 1, 0, h - 1);
+        x0 = std::clamp(x0, 0, w - 1);
+        y0 = std::clamp(y0, 0, h - 1);
+        return (1 - ay) * ((1 - ax) * texel(level, x0, y0) + ax * texel(level, x1, y0))
+             + ay * ((1 - ax) * texel(level, x0, y1) + ax * texel(level, x1, y1));
+    }
+
+    // Trilinear lookup. footprint is the width of the area to filter in
+    // texture coordinates, 0 samples the full resolution level.
+    vec3 sample(float u, float v, float footprint) const {
+        float texels = footprint * std::max(width(), height());
+        float lod = texels > 1 ? std::log2(texels) : 0;
+        int last = levels_count() - 1;
+        if (lod >= last)
+            return bilinear(last, u, v);
+        int level = int(lod);
+        float f = lod - level;
+        if (f == 0)
+            return bilinear(level, u, v);
+        return (1 - f) * bilinear(level, u, v) + f * bilinear(level + 1, u, v);
+    }
+};
+
+// Builds the next mip level with a 2x2 box filter.
+inline mip_level downsample(const mip_level& src)
+{
+    mip_level dst(std::max(1, src.width / 2), std::max(1, src.height / 2));
+    for (int y = 0; y < dst.height; y++) {
+        for (int x = 0; x < dst.width; x++) {
+            int x0 = std::min(2 * x, src.width - 1), x1 = std::min(2 * x + 1, src.width - 1);
+            int y0 = std::min(2 * y, src.height - 1), y1 = std::min(2 * y + 1, src.height - 1);
+            for (int c = 0; c < 4; c++) {
+                int sum = src.rgba(x0, y0)[c] + src.rgba(x1, y0)[c]
+                        + src.rgba(x0, y1)[c] + src.rgba(x1, y1)[c];
+                dst.rgba(x, y)[c] = (sum + 2) / 4;
+            }
+        }
+    }
+    return dst;
+}
+
+// Decoded RGBA8 image with all of its levels in memory.
+class image : public mipmapped_image {
+public:
+    std::vector<mip_level> levels;
+
+    // Makes an image from row-major RGBA8 pixels and builds its mip levels.
+    static std::shared_ptr<image> from_rgba(const unsigned char* pixels, int w, int h) {
+        auto img = std::make_shared<image>();
+        mip_level base(w, h);
+        for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++)
+                std::copy(pixels + 4 * (x + w * y), pixels + 4 * (x + w * y) + 4, base.rgba(x, y));
+        img->levels.push_back(std::move(base));
+        while (img->levels.back().width > 1 || img->levels.back().height > 1)
+            img->levels.push_back(downsample(img->levels.back()));
+        return img;
+    }
+
+    int levels_count() const override { return levels.size(); }
+    int level_width(int level) const override { return levels[level].width; }
+    int level_height(int level) const override { return levels[level].height; }
+    vec3 texel(int level, int x, int y) const override { return levels[level].texel(x, y); }
+};
@@ -0,0 +1,146 @@
+#pragma once
+
+#include "compressed_image.h"
+#include "image.h"
+#include "tiled_image.h"
+
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// Opens each image file once and shares it between all users, so
+// materials that reuse one texture atlas hold a single copy of it.
+class image_store {
+public:
+    static image_store& get() {
+        static image_store store;
+        return store;
+    }
+
+    enum class storage { tiled, compressed };
+
+    // How load_texture keeps textures of loaded models
+    storage texture_storage = storage::tiled;
+    // Where load_tiled keeps its tiled files, created on first use. Empty
+    // means the system's temporary directory.
+    std::string tiled_directory;
+
+    std::shared_ptr<const mipmapped_image> load_texture(const std::string& path) {
+        if (texture_storage == storage::compressed)
+            return load_compressed(path);
+        return load_tiled(path);
+    }
+
+    // Returns nullptr if the file could not be decoded.
+    std::shared_ptr<const image> load(const std::string& path) {
+        std::string key = key_of(path);
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = images.find(key);
+        if (it != images.end())
+            return it->second;
+
+        std::shared_ptr<const image> img = decode(path);
+        if (img)
+            images[key] = img;
+        return img;
+    }
+
+    // Like load, but keeps only the header in memory and reads tiles
+    // through texture_cache on demand. The image is converted to a tiled
+    // file in tiled_directory first when that file is missing or older than
+    // it. If the tiled file cannot be written, the decoded image is
+    // returned.
+    std::shared_ptr<const mipmapped_image> load_tiled(const std::string& path) {
+        std::string key = key_of(path);
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = tiled_images.find(key);
+        if (it != tiled_images.end())
+            return it->second;
+
+        std::string tiled_path = tiled_path_of(key);
+        // A tiled file whose time cannot be read is converted again. One
+        // whose source cannot be checked is used as it is.
+        std::error_code tiled_ec, source_ec;
+        auto tiled_time = std::filesystem::last_write_time(tiled_path, tiled_ec);
+        auto source_time = std::filesystem::last_write_time(path, source_ec);
+        bool stale = tiled_ec || (!source_ec && tiled_time < source_time);
+        std::shared_ptr<const mipmapped_image> img;
+        if (!stale)
+            img = tiled_image::open(tiled_path);
+        if (!img) {
+            // decoded only for the conversion, and dropped afterwards
+            std::shared_ptr<const image> decoded = decode(path);
+            if (!decoded)
+                return nullptr;
+            if (tiled_image::write(tiled_path, *decoded))
+                img = tiled_image::open(tiled_path);
+            if (!img) {
+                std::cerr << "Failed to write " << tiled_path << ", keeping " << path << " in memory" << std::endl;
+                img = decoded;
+            }
+        }
+        tiled_images[key] = img;
+        return img;
+    }
+
+    // Like load, but encodes the image to BC1 blocks and keeps only those,
+    // an eighth of the decoded size.
+    std::shared_ptr<const mipmapped_image> load_compressed(const std::string& path) {
+        std::string key = key_of(path);
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = compressed_images.find(key);
+        if (it != compressed_images.end())
+            return it->second;
+
+        std::shared_ptr<const image> decoded = decode(path);
+        if (!decoded)
+            return nullptr;
+        std::shared_ptr<const mipmapped_image> img = compressed_image::encode(*decoded);
+        compressed_images[key] = img;
+        return img;
+    }
+
+private:
+    static std::string key_of(const std::string& path) {
+        std::error_code ec;
+        std::string key = std::filesystem::weakly_canonical(path, ec).string();
+        return ec ? path : key;
+    }
+
+    // Named by the file name and a hash of the whole key, so images of the
+    // same name in different directories do not share a tiled file.
+    std::string tiled_path_of(const std::string& key) const {
+        std::error_code ec;
+        std::filesystem::path directory = tiled_directory;
+        if (directory.empty())
+            directory = std::filesystem::temp_directory_path(ec) / "tiled_textures";
+        std::filesystem::create_directories(directory, ec);
+        char hash[17];
+        std::snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)std::hash<std::string>()(key));
+        std::string name = std::filesystem::path(key).filename().string() + "." + hash + ".tiled";
+        return (directory / name).string();
+    }
+
+    // Returns nullptr if the file could not be decoded.
+    static std::shared_ptr<const image> decode(const std::string& path) {
+        int nx, ny, nn;
+        unsigned char* data = stbi_load(path.c_str(), &nx, &ny, &nn, STBI_rgb_alpha);
+        if (!data) {
+            std::cerr << "Failed to open: " << path << std::endl;
+            return nullptr;
+        }
+        std::shared_ptr<const image> img = image::from_rgba(data, nx, ny);
+        stbi_image_free(data);
+        return img;
+    }
+
+    std::mutex mutex;
+    std::map<std::string, std::shared_ptr<const image>> images;
+    std::map<std::string, std::shared_ptr<const mipmapped_image>> tiled_images;
+    std::map<std::string, std::shared_ptr<const mipmapped_image>> compressed_images;
+};
@@ -0,0 +1,468 @@
+#pragma once
+
+#include "aabb.h"
+#include "common.h"
+#include "environment.h"
+#include "hitable.h"
+#include "material.h"
+#include "volume.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <tuple>
+#include <vector>
+
+// A hit where light_bvh::direct_light() sampled the lights, kept with the
+// ray scattered from it to weight the emission that ray finds.
+struct light_vertex {
+    vec3 p;
+    // the normal the emitters were picked for, 0 in media
+    vec3 n;
+    // probability density of the scattered direction
+    float pdf;
+};
+
+// Hierarchy over the emitters of a scene, to pick one to sample from a
+// shading point. Each node bounds its emitters by a box, a cone holding
+// their normals and their total power, after Conty and Kulla, "Importance
+// Sampling of Many Lights with Adaptive Tree Splitting". A pick descends from
+// the root taking each child with probability proportional to a bound of the
+// light it can send to the point, so it costs O(log n) and favours bright,
+// near emitters that face the point over the others.
+//
+// Light sampling and the scattered rays of a hit both find the emitters. Their
+// estimates are combined by multiple importance sampling with the power
+// heuristic, see direct_light() and emission_weight(). A sky, if given, is
+// sampled alongside the emitters and weighted the same way, see sky_weight().
+class light_bvh {
+public:
+    // Emitters of more triangles under one object, like a mesh instance, are
+    // lit only by light sampling. Their hits cannot cheaply tell which
+    // triangle was hit, which the weights need.
+    static const int max_weighted_emitters = 8;
+
+    explicit light_bvh(const hitable* world, const environment* sky = nullptr) : sky(sky) {
+        world->emitters(lights);
+        // spatial splits may reference a primitive from several leaves
+        auto key = [](const emitter& e) {
+            return std::make_tuple(e.obj, e.prim, e.v0[0], e.v0[1], e.v0[2], e.v1[0], e.v1[1], e.v1[2], e.v2[0], e.v2[1], e.v2[2]);
+        };
+        std::sort(lights.begin(), lights.end(), [&key](const emitter& a, const emitter& b) { return key(a) < key(b); });
+        lights.erase(std::unique(lights.begin(), lights.end(), [&key](const emitter& a, const emitter& b) { return key(a) == key(b); }), lights.end());
+        lights.erase(std::remove_if(lights.begin(), lights.end(), [](const emitter& e) { return !(e.area() > 0); }), lights.end());
+
+        // sorted by object, so each object's emitters are consecutive
+        for (int i = 0; i < int(lights.size()); i++) {
+            if (objects.empty() || objects.back() != lights[i].obj) {
+                objects.push_back(lights[i].obj);
+                object_first.push_back(i);
+            }
+        }
+        object_first.push_back(lights.size());
+
+        std::vector<int> order(lights.size());
+        for (int i = 0; i < int(lights.size()); i++)
+            order[i] = i;
+        leaf_of.resize(lights.size());
+        if (!lights.empty())
+            build(order, 0, order.size(), -1);
+    }
+
+    // Picks an emitter to light p, on a surface with normal n or in a medium
+    // if n is 0, with u uniform in [0, 1). Returns its index in lights and
+    // the probability of the pick in pmf, or -1 if no emitter can light p.
+    int sample(const vec3& p, const vec3& n, float u, float& pmf) const {
+        pmf = 1;
+        if (nodes.empty() || (nodes[0].leaf && importance(nodes[0].bounds, p, n) <= 0))
+            return -1;
+        int i = 0;
+        while (!nodes[i].leaf) {
+            int left = i + 1;
+            int right = nodes[i].index;
+            float w_left = importance(nodes[left].bounds, p, n);
+            float w_right = importance(nodes[right].bounds, p, n);
+            if (w_left + w_right <= 0)
+                return -1;
+            float p_left = w_left / (w_left + w_right);
+            if (u < p_left) {
+                u = std::min(u / p_left, 0.99999994f);
+                pmf *= p_left;
+                i = left;
+            } else {
+                u = std::min((u - p_left) / (1 - p_left), 0.99999994f);
+                pmf *= 1 - p_left;
+                i = right;
+            }
+        }
+        return nodes[i].index;
+    }
+
+    // Probability that sample() picks lights[light] for p and n, walking up
+    // from its leaf.
+    float pmf(const vec3& p, const vec3& n, int light) const {
+        int i = leaf_of[light];
+        if (i == 0)
+            return importance(nodes[0].bounds, p, n) > 0 ? 1 : 0;
+        float result = 1;
+        while (i != 0) {
+            int parent = nodes[i].parent;
+            int left = parent + 1;
+            float w_left = importance(nodes[left].bounds, p, n);
+            float w_right = importance(nodes[nodes[parent].index].bounds, p, n);
+            if (w_left + w_right <= 0)
+                return 0;
+            result *= (i == left ? w_left : w_right) / (w_left + w_right);
+            i = parent;
+        }
+        return result;
+    }
+
+    // Estimates the light arriving at rec from the emitters and the sky and
+    // scattered back along r_in, by sampling a point on one emitter and a
+    // direction toward the sky and tracing shadow rays to them. Returns false
+    // if the material of rec cannot be evaluated for a given direction, like
+    // mirrors and glass; then the lights have to be found by scattered rays
+    // alone. Otherwise fills from for weighting what scattered, the ray the
+    // material picked, finds.
+    bool direct_light(const ray& r_in, const hit_record& rec, const ray& scattered, const hitable* world, vec3& light, light_vertex& from) const {
+        light = vec3(0, 0, 0);
+        vec3 value;
+        if (!rec.mat_ptr->scattering(r_in, rec, scattered.direction(), value, from.pdf))
+            return false;
+        from.p = rec.p;
+        // points in media have no normal facing the light
+        from.n = rec.mat_ptr->kind == material_kind::isotropic ? vec3(0, 0, 0) : rec.normal;
+        light = emitter_light(r_in, rec, world, from.n);
+        if (sky)
+            light += sky_light(r_in, rec, world);
+        return true;
+    }
+
+    // Weight of the emission at p on obj, found by the ray scattered from
+    // from, against direct_light() at from having sampled it too.
+    float emission_weight(const light_vertex& from, const hitable* obj, const vec3& p) const {
+        auto it = std::lower_bound(objects.begin(), objects.end(), obj);
+        if (it == objects.end() || *it != obj)
+            return 1;
+        if (!weighted(obj))
+            return 0;
+        // the triangle of obj p is on, as far as rounding allows
+        int first = object_first[it - objects.begin()];
+        int last = object_first[it - objects.begin() + 1];
+        int light = first;
+        float best = std::numeric_limits<float>::lowest();
+        for (int i = first; i < last; i++) {
+            float inside = lights[i].inside(p);
+            if (inside > best) {
+                best = inside;
+                light = i;
+            }
+        }
+        const emitter& e = lights[light];
+        vec3 d = p - from.p;
+        float distance = d.length();
+        float cosine = fabs(dot(e.normal(), d)) / distance;
+        float light_pdf = pmf(from.p, from.n, light) * distance * distance / (cosine * e.area());
+        return power_heuristic(from.pdf, light_pdf);
+    }
+
+    // Weight of the sky seen in direction by the ray scattered from from.
+    float sky_weight(const light_vertex& from, const vec3& direction) const {
+        if (!sky)
+            return 1;
+        return power_heuristic(from.pdf, sky->pdf(direction));
+    }
+
+    // Weight of a sample drawn with density pdf against another strategy
+    // that would draw it with other_pdf.
+    static float power_heuristic(float pdf, float other_pdf) {
+        return pdf * pdf / (pdf * pdf + other_pdf * other_pdf);
+    }
+
+    std::vector<emitter> lights;
+    const environment* sky;
+
+private:
+    struct light_bounds {
+        aabb box;
+        // normals are within acos(cos_theta) of axis, or of -axis too if
+        // two_sided
+        vec3 axis;
+        float cos_theta;
+        float power;
+        bool two_sided;
+    };
+
+    // Nodes are stored depth first: the left child follows its parent, and
+    // index is the right child, or the emitter for leaves. The root has no
+    // parent, -1.
+    struct light_node {
+        light_bounds bounds;
+        int index;
+        int parent;
+        bool leaf;
+    };
+
+    vec3 emitter_light(const ray& r_in, const hit_record& rec, const hitable* world, const vec3& n) const {
+        float pmf;
+        int i = sample(rec.p, n, rand_float(), pmf);
+        if (i < 0)
+            return vec3(0, 0, 0);
+        const emitter& e = lights[i];
+        vec3 d = e.point(rand_float(), rand_float()) - rec.p;
+        vec3 value;
+        float scatter_pdf;
+        if (!rec.mat_ptr->scattering(r_in, rec, d, value, scatter_pdf))
+            return vec3(0, 0, 0);
+        float distance = d.length();
+        float cosine = -dot(e.normal(), d) / distance;
+        if (e.two_sided)
+            cosine = fabs(cosine);
+        if (max_component(value) <= 0 || cosine <= 0)
+            return vec3(0, 0, 0);
+        // The shadow ray has to reach the sampled emitter, whose surface then
+        // gives the emitted radiance. A constant_medium it passes collides
+        // with it by delta tracking, so it gets through with the medium's
+        // transmittance; a grid_medium multiplies its transmittance in.
+        ray shadow = r_in.transformed(rec.p, d / distance);
+        hit_info hit;
+        float transmittance = 1;
+        shadow_transmittance::current = &transmittance;
+        bool reached = world->hit(shadow, 0.001, distance * 1.001f, hit) && hit.t >= distance * 0.999f && hit.obj == e.obj;
+        shadow_transmittance::current = nullptr;
+        if (!reached || transmittance <= 0)
+            return vec3(0, 0, 0);
+        hit_record light_rec;
+        finish_hit(shadow, hit, light_rec);
+        vec3 emitted = light_rec.mat_ptr->emitted(light_rec.u, light_rec.v, light_rec.p);
+        // density of d per solid angle
+        float light_pdf = pmf * distance * distance / (cosine * e.area());
+        float weight = weighted(e.obj) ? power_heuristic(light_pdf, scatter_pdf) : 1;
+        return value * emitted * (transmittance * weight / light_pdf);
+    }
+
+    // The sky is reached by shadow rays that hit nothing at all.
+    vec3 sky_light(const ray& r_in, const hit_record& rec, const hitable* world) const {
+        vec3 d;
+        float sky_pdf;
+        if (!sky->sample(rand_float(), rand_float(), rand_float(), d, sky_pdf))
+            return vec3(0, 0, 0);
+        vec3 value;
+        float scatter_pdf;
+        if (!rec.mat_ptr->scattering(r_in, rec, d, value, scatter_pdf) || max_component(value) <= 0)
+            return vec3(0, 0, 0);
+        hit_info hit;
+        float transmittance = 1;
+        shadow_transmittance::current = &transmittance;
+        bool blocked = world->hit(r_in.transformed(rec.p, d), 0.001, 1e9, hit);
+        shadow_transmittance::current = nullptr;
+        if (blocked || transmittance <= 0)
+            return vec3(0, 0, 0);
+        return value * sky->radiance(d) * (transmittance * power_heuristic(sky_pdf, scatter_pdf) / sky_pdf);
+    }
+
+    // Whether hits on obj are weighted against light sampling, see
+    // max_weighted_emitters.
+    bool weighted(const hitable* obj) const {
+        auto it = std::lower_bound(objects.begin(), objects.end(), obj);
+        // not an object with emitters
+        if (it == objects.end() || *it != obj)
+            return false;
+        int k = it - objects.begin();
+        return object_first[k + 1] - object_first[k] <= max_weighted_emitters;
+    }
+
+    static light_bounds emitter_bounds(const emitter& e) {
+        light_bounds b;
+        b.box = aabb(min(min(e.v0, e.v1), e.v2), max(max(e.v0, e.v1), e.v2));
+        b.axis = e.normal();
+        b.cos_theta = 1;
+        b.two_sided = e.two_sided;
+        b.power = (e.radiance[0] + e.radiance[1] + e.radiance[2]) / 3 * e.area() * (e.two_sided ? 2 : 1);
+        return b;
+    }
+
+    static light_bounds merge(const light_bounds& a, const light_bounds& b) {
+        light_bounds m;
+        m.box = surrounding_box(a.box, b.box);
+        m.power = a.power + b.power;
+        m.two_sided = a.two_sided || b.two_sided;
+        // a two-sided cone holds both directions, take the one near a's
+        vec3 b_axis = m.two_sided && dot(a.axis, b.axis) < 0 ? -b.axis : b.axis;
+        float cos_d = std::clamp(dot(a.axis, b_axis), -1.0f, 1.0f);
+        float theta_a = acos(a.cos_theta);
+        float theta_b = acos(b.cos_theta);
+        float theta_d = acos(cos_d);
+        if (std::min(theta_d + theta_b, float(M_PI)) <= theta_a) {
+            m.axis = a.axis;
+            m.cos_theta = a.cos_theta;
+            return m;
+        }
+        if (std::min(theta_d + theta_a, float(M_PI)) <= theta_b) {
+            m.axis = b_axis;
+            m.cos_theta = b.cos_theta;
+            return m;
+        }
+        // the cone touching both, its axis turned from a's towards b's
+        float theta_o = (theta_a + theta_d + theta_b) / 2;
+        vec3 ortho = b_axis - cos_d * a.axis;
+        if (theta_o >= float(M_PI) || ortho.length() < 1e-6f) {
+            m.axis = a.axis;
+            m.cos_theta = -1;
+            return m;
+        }
+        float turn = theta_o - theta_a;
+        m.axis = unit_vector(cos(turn) * a.axis + sin(turn) * unit_vector(ortho));
+        // a little wider, so rounding never leaves a normal outside
+        m.cos_theta = cos(std::min(theta_o + 1e-4f, float(M_PI)));
+        return m;
+    }
+
+    // Bound of the light the emitters of b send to p, up to a constant: the
+    // power over the squared distance, times the cosines at both ends at
+    // the smallest angles the box and the normal cone allow.
+    static float importance(const light_bounds& b, const vec3& p, const vec3& n) {
+        vec3 d = p - (b.box.min() + b.box.max()) / 2;
+        float dist2 = d.norm();
+        // squared radius of the sphere around the box
+        float radius2 = (b.box.max() - b.box.min()).norm() / 4;
+        if (dist2 <= radius2)
+            return b.power / std::max(radius2, 1e-12f);
+        vec3 w = d / sqrt(dist2);
+        // the sphere covers angles up to theta_b around -w seen from p
+        float sin_b = sqrt(radius2 / dist2);
+        float cos_b = sqrt(1 - radius2 / dist2);
+
+        // emitting side, theta_w - theta_o - theta_b
+        float cos_w = dot(b.axis, w);
+        if (b.two_sided)
+            cos_w = fabs(cos_w);
+        float sin_w = sqrt(std::max(0.0f, 1 - cos_w * cos_w));
+        float cos_o = b.cos_theta;
+        float sin_o = sqrt(std::max(0.0f, 1 - cos_o * cos_o));
+        float cos_x = 1, sin_x = 0;
+        if (cos_w < cos_o) {
+            cos_x = cos_w * cos_o + sin_w * sin_o;
+            sin_x = sin_w * cos_o - cos_w * sin_o;
+        }
+        float cos_e = cos_x < cos_b ? cos_x * cos_b + sin_x * sin_b : 1;
+        if (cos_e <= 0)
+            return 0;
+        float value = b.power * cos_e / dist2;
+
+        // receiving side, theta_i - theta_b
+        if (n.norm() > 0) {
+            float cos_i = -dot(n, w);
+            float sin_i = sqrt(std::max(0.0f, 1 - cos_i * cos_i));
+            float cos_r = cos_i < cos_b ? cos_i * cos_b + sin_i * sin_b : 1;
+            if (cos_r <= 0)
+                return 0;
+            value *= cos_r;
+        }
+        return value;
+    }
+
+    // Measure of the directions lit by a cone of normals, each lighting
+    // the hemisphere around it.
+    static float orientation_measure(float cos_theta) {
+        float theta_o = acos(cos_theta);
+        float theta_w = std::min(theta_o + float(M_PI / 2), float(M_PI));
+        float sin_o = sin(theta_o);
+        return float(2 * M_PI) * (1 - cos_theta) + float(M_PI / 2) * (2 * theta_w * sin_o - cos(theta_o - 2 * theta_w) - 2 * theta_o * sin_o + cos_theta);
+    }
+
+    static float split_cost(const light_bounds& b) {
+        return b.power * b.box.area() * orientation_measure(b.cos_theta);
+    }
+
+    // Builds the subtree over lights order[begin, end) and returns its index.
+    // Splits in 12 bins along each axis, minimizing the surface area
+    // orientation heuristic of the paper.
+    int build(std::vector<int>& order, int begin, int end, int parent) {
+        int index = nodes.size();
+        nodes.push_back(light_node());
+        nodes[index].parent = parent;
+        auto centroid = [this](int light) {
+            const emitter& e = lights[light];
+            return (e.v0 + e.v1 + e.v2) / 3;
+        };
+        light_bounds bounds = emitter_bounds(lights[order[begin]]);
+        aabb centers(centroid(order[begin]), centroid(order[begin]));
+        for (int k = begin + 1; k < end; k++) {
+            bounds = merge(bounds, emitter_bounds(lights[order[k]]));
+            vec3 c = centroid(order[k]);
+            centers = aabb(min(centers.min(), c), max(centers.max(), c));
+        }
+        nodes[index].bounds = bounds;
+        if (end - begin == 1) {
+            nodes[index].leaf = true;
+            nodes[index].index = order[begin];
+            leaf_of[order[begin]] = index;
+            return index;
+        }
+
+        const int bins = 12;
+        float best_cost = std::numeric_limits<float>::max();
+        int best_axis = -1, best_split = 0;
+        vec3 extent = centers.max() - centers.min();
+        auto bin_of = [&](int light, int axis) {
+            float c = centroid(light)[axis];
+            return std::min(int(bins * (c - centers.min()[axis]) / extent[axis]), bins - 1);
+        };
+        for (int axis = 0; axis < 3; axis++) {
+            if (!(extent[axis] > 0))
+                continue;
+            light_bounds bin_bounds[bins];
+            int counts[bins] = {};
+            for (int k = begin; k < end; k++) {
+                int b = bin_of(order[k], axis);
+                light_bounds lb = emitter_bounds(lights[order[k]]);
+                bin_bounds[b] = counts[b]++ ? merge(bin_bounds[b], lb) : lb;
+            }
+            // costs of bins [0, s) swept from the left, then from the right
+            float left_cost[bins];
+            light_bounds acc;
+            int count = 0;
+            for (int s = 1; s < bins; s++) {
+                if (counts[s - 1])
+                    acc = count ? merge(acc, bin_bounds[s - 1]) : bin_bounds[s - 1];
+                count += counts[s - 1];
+                left_cost[s] = count ? split_cost(acc) : -1;
+            }
+            count = 0;
+            for (int s = bins - 1; s >= 1; s--) {
+                if (counts[s])
+                    acc = count ? merge(acc, bin_bounds[s]) : bin_bounds[s];
+                count += counts[s];
+                if (!count || left_cost[s] < 0)
+                    continue;
+                float cost = left_cost[s] + split_cost(acc);
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_split = s;
+                }
+            }
+        }
+
+        int mid = (begin + end) / 2;
+        if (best_axis >= 0) {
+            mid = std::partition(order.begin() + begin, order.begin() + end, [&](int light) {
+                return bin_of(light, best_axis) < best_split;
+            }) - order.begin();
+        }
+        build(order, begin, mid, index);
+        nodes[index].leaf = false;
+        nodes[index].index = build(order, mid, end, index);
+        return index;
+    }
+
+    std::vector<light_node> nodes;
+    // node of each emitter
+    std::vector<int> leaf_of;
+    // objects named by the emitters' hits, sorted, and the first of their
+    // emitters, with lights.size() at the end
+    std::vector<const hitable*> objects;
+    std::vector<int> object_first;
+};
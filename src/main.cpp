@@ -1,16 +1,24 @@
+#include "bake.h"
+#include "bench.h"
 #include "bvh.h"
 #include "camera.h"
 #include "common.h"
+#include "denoise.h"
 #include "vec3.h"
 #include "ray.h"
 #include "texture.h"
+#include "environment.h"
 #include "hitable_list.h"
+#include "light.h"
 #include "material.h"
 #include "moving_sphere.h"
 #include "sphere.h"
 #include "rect.h"
+#include "sbvh.h"
 #include "volume.h"
+#include "wavefront.h"
 #include "obj_loader.h"
+#include "packet.h"
 
 #include <algorithm>
 #include <climits>
@@ -20,19 +28,47 @@
 #include <fstream>
 #include <iostream>
 
-vec3 color(const ray& r, hitable *world, int depth=0)
+vec3 shade(const ray& r, const hit_info& hit, hitable *world, const environment* sky, int depth=0, const light_bvh* lights=nullptr, const light_vertex* from=nullptr);
+
+// Rays leaving the scene see sky, or black without one. With lights,
+// emitters are also sampled directly at each hit that allows it. from is the
+// hit r was scattered from if it did so.
+vec3 color(const ray& r, hitable *world, const environment* sky, int depth=0, const light_bvh* lights=nullptr, const light_vertex* from=nullptr)
 {
-    hit_record rec;
-    if (world->hit(r, 0.001, 1e9, rec)) {
-        ray scattered;
-        vec3 attenuation;
-        vec3 emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
-        if (depth < 50 && rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-            return emitted + attenuation * color(scattered, world, depth+1);
-        else
-            return emitted;
-    } else
+    hit_info hit;
+    if (world->hit(r, 0.001, 1e9, hit))
+        return shade(r, hit, world, sky, depth, lights, from);
+    if (!sky)
         return vec3(0, 0, 0);
+    vec3 background = sky->radiance(r.direction());
+    // sampling the lights at from found this sky too
+    if (from)
+        background *= lights->sky_weight(*from, r.direction());
+    return background;
+}
+
+// Light leaving the hit of r back along r.
+vec3 shade(const ray& r, const hit_info& hit, hitable *world, const environment* sky, int depth, const light_bvh* lights, const light_vertex* from)
+{
+    hit_record rec;
+    finish_hit(r, hit, rec);
+    ray scattered;
+    vec3 attenuation;
+    vec3 emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+    // sampling the lights at from found this emission too
+    if (from && max_component(emitted) > 0)
+        emitted *= lights->emission_weight(*from, hit.obj, rec.p);
+    if (depth < 50 && rec.mat_ptr->scatter(r, rec, attenuation, scattered)) {
+        // Keep growing the footprint of the path for texture filtering.
+        scattered.cone_width = r.footprint(rec.t);
+        scattered.cone_spread = r.cone_spread;
+        vec3 direct(0, 0, 0);
+        light_vertex vertex;
+        bool sampled = lights && lights->direct_light(r, rec, scattered, world, direct, vertex);
+        return emitted + direct + attenuation * color(scattered, world, sky, depth+1, lights, sampled ? &vertex : nullptr);
+    }
+    else
+        return emitted;
 }
 
 hitable *random_scene()
@@ -70,7 +106,7 @@ hitable *random_scene()
     }
     hitable** ret = new hitable*[10];
     int ret_i = 0;
-    ret[ret_i++] = new bvh_node(list, i, 0, 1);
+    ret[ret_i++] = new motion_bvh_node(list, i, 0, 1);
     ret[ret_i++] = new sphere(vec3(0, -1000, 0), 1000, new lambertian(new checker_texture(new constant_texture(vec3(0.3, 0.3, 0.3)), new constant_texture(vec3(0.9, 0.9, 0.9)))));
     ret[ret_i++] = new sphere(vec3(0, 1, 0), 1.0, new dielectric(1.5));
     ret[ret_i++] = new sphere(vec3(-4, 1, 0), 1.0, new lambertian(new constant_texture(vec3(0.4, 0.2, 0.1))));
@@ -79,12 +115,16 @@ hitable *random_scene()
     return new hitable_list(ret, ret_i);
 }
 
-hitable* two_perlin_spheres()
+// With bake, the small sphere shades from a baked copy of the noise.
+hitable* two_perlin_spheres(bool bake = false)
 {
     texture* pertext = new noise_texture();
     hitable** list = new hitable*[2];
     list[0] = new sphere(vec3(0, -1000, 0), 1000, new lambertian(pertext));
-    list[1] = new sphere(vec3(0, 2, 0), 2, new lambertian(pertext));
+    sphere* small = new sphere(vec3(0, 2, 0), 2, new lambertian(pertext));
+    if (bake)
+        small->mat_ptr = new lambertian(bake_texture(pertext, small, 1024));
+    list[1] = small;
     return new hitable_list(list, 2);
 }
 
@@ -125,6 +165,64 @@ hitable* cornell_box()
     return new hitable_list(list, i);
 }
 
+// Cornell box with a noise cloud stored in a sparse brick_grid.
+hitable* cornell_cloud()
+{
+    vec3 center(278, 278, 278);
+    float radius = 180;
+    perlin* noise = new perlin();
+    brick_grid* grid = new brick_grid(aabb(vec3(0, 0, 0), vec3(555, 555, 555)), 128);
+    grid->fill([noise, center, radius](const vec3& p) {
+        float falloff = 1 - (p - center).length() / radius;
+        return falloff > 0 ? falloff * noise->turb(p * 0.02f) : 0.0f;
+    });
+    hitable** list = new hitable*[2];
+    list[0] = cornell_box();
+    list[1] = new grid_medium(grid, 0.05, new constant_texture(vec3(0.9, 0.9, 0.9)));
+    return new hitable_list(list, 2);
+}
+
+// A street at night, lit only by the signs on the buildings along it: a few
+// thousand small emissive triangles. Meant for light_sampling.
+hitable* night_street()
+{
+    const int buildings = 16;
+    const int signs = 60;
+    hitable** list = new hitable*[1 + 2 * buildings * (1 + 2 * signs)];
+    int i = 0;
+    material* ground = new lambertian(new constant_texture(vec3(0.4, 0.4, 0.4)));
+    material* wall = new lambertian(new constant_texture(vec3(0.5, 0.45, 0.4)));
+    list[i++] = new xz_rect(-100, 100, -100, 100, 0, ground);
+    // side -1 faces the street at z = -5, side 1 at z = 5
+    for (int side = -1; side <= 1; side += 2) {
+        for (int b = 0; b < buildings; b++) {
+            float x0 = -40 + 5 * b;
+            float height = 6 + 10 * rand_float();
+            float face = 5 * side;
+            list[i++] = new box(vec3(x0, 0, std::min(face, 2.2f * face)), vec3(x0 + 4.5, height, std::max(face, 2.2f * face)), wall);
+            for (int k = 0; k < signs; k++) {
+                float w = 0.2 + 0.6 * rand_float();
+                float h = 0.1 + 0.3 * rand_float();
+                float x = x0 + (4.5 - w) * rand_float();
+                float y = 1 + (height - 2) * rand_float();
+                vec3 c(rand_float(), rand_float(), rand_float());
+                material* light = new diffuse_light(new constant_texture((4 + 12 * rand_float()) * c / max_component(c)));
+                // a little in front of the wall, facing the street
+                float z = face - 0.01 * side;
+                vec3 corners[4] = { vec3(x, y, z), vec3(x + w, y, z), vec3(x + w, y + h, z), vec3(x, y + h, z) };
+                for (int t = 0; t < 2; t++) {
+                    triangle_parameter param;
+                    param.v0 = corners[0];
+                    param.v1 = corners[side > 0 ? 2 + t : 1 + t];
+                    param.v2 = corners[side > 0 ? 1 + t : 2 + t];
+                    list[i++] = new triangle(param, light);
+                }
+            }
+        }
+    }
+    return new bvh_node(list, i, 0, 1);
+}
+
 hitable* triangle_test()
 {
     hitable** ret = new hitable*[30];
@@ -188,7 +286,9 @@ hitable* triangle_test()
     return new hitable_list(ret, ret_i);
 }
 
-hitable* make_hitable_from_obj(const std::string& path)
+// spatial_splits builds the per-object BVHs with build_sbvh(), which is
+// slower but traces faster for meshes with long thin triangles.
+hitable* make_hitable_from_obj(const std::string& path, bool spatial_splits = false)
 {
     const int START_T = 0;
     const int END_T = 1;
@@ -243,17 +343,23 @@ hitable* make_hitable_from_obj(const std::string& path)
             }
             faces[face_i++] = new triangle(param, mat);
         }
-        objects[objects_i++] = new bvh_node(faces, face_i, START_T, END_T);
+        if (spatial_splits)
+            objects[objects_i++] = build_sbvh(faces, face_i, START_T, END_T);
+        else
+            objects[objects_i++] = new bvh_node(faces, face_i, START_T, END_T);
     }
     return new bvh_node(objects, objects_i, START_T, END_T);
 }
 
-hitable* model_test()
+// With sky, the scene is lit by an environment map instead of the rect
+// overhead.
+hitable* model_test(bool sky = false)
 {
     hitable** ret = new hitable*[30];
     int ret_i = 0;
     ret[ret_i++] = new sphere(vec3(0, -1000, 0), 1000, new lambertian(new checker_texture(new constant_texture(vec3(0.3, 0.3, 0.3)), new constant_texture(vec3(0.9, 0.9, 0.9)))));
-    ret[ret_i++] = new xz_rect(-10000, 10000, -10000, 10000, 1000, new diffuse_light(new constant_texture(vec3(1.0, 1.0, 1.0))));
+    if (!sky)
+        ret[ret_i++] = new xz_rect(-10000, 10000, -10000, 10000, 1000, new diffuse_light(new constant_texture(vec3(1.0, 1.0, 1.0))));
     hitable* obj = make_hitable_from_obj("iruka.obj");
     if (obj == nullptr)
         throw std::runtime_error("Failed to load object");
@@ -262,6 +368,38 @@ hitable* model_test()
     return new hitable_list(ret, ret_i);
 }
 
+// With sky, the scene is lit by an environment map instead of the rect
+// overhead.
+hitable* forest_test(bool sky = false)
+{
+    hitable** ret = new hitable*[30];
+    int ret_i = 0;
+    ret[ret_i++] = new sphere(vec3(0, -1000, 0), 1000, new lambertian(new checker_texture(new constant_texture(vec3(0.3, 0.3, 0.3)), new constant_texture(vec3(0.9, 0.9, 0.9)))));
+    if (!sky)
+        ret[ret_i++] = new xz_rect(-10000, 10000, -10000, 10000, 1000, new diffuse_light(new constant_texture(vec3(1.0, 1.0, 1.0))));
+    // Load the mesh once and share its BVH between all instances.
+    hitable* obj = make_hitable_from_obj("iruka.obj");
+    if (obj == nullptr)
+        throw std::runtime_error("Failed to load object");
+
+    const int n = 40;
+    hitable** instances = new hitable*[n * n];
+    int instances_i = 0;
+    for (int a = 0; a < n; a++) {
+        for (int b = 0; b < n; b++) {
+            vec3 position(4 * (a - n / 2) + 2 * rand_float(), 0, 4 * (b - n / 2) + 2 * rand_float());
+            float scale = 0.5 + rand_float();
+            mat34 transform = mat34::translation(position)
+                            * mat34::rotation(vec3(0, 1, 0), 360 * rand_float())
+                            * mat34::scaling(vec3(scale, scale, scale));
+            instances[instances_i++] = new instance(obj, transform);
+        }
+    }
+    ret[ret_i++] = new bvh_node(instances, instances_i, 0, 1);
+
+    return new hitable_list(ret, ret_i);
+}
+
 // hitable* texture_scene()
 // {
 //     int nx, ny, nn;
@@ -270,6 +408,33 @@ hitable* model_test()
 //     return new sphere(vec3(0, 2, 0), 2, mat);
 // }
 
+// Writes the nx x ny image whose gamma corrected pixel (i, j) is
+// pixel(i, j), row j = 0 at the bottom.
+template <typename Pixel>
+void write_ppm(const std::string& path, int nx, int ny, Pixel pixel)
+{
+    std::fstream fs(path, std::ios::out | std::ios::trunc);
+    fs << "P3" << std::endl
+       << nx << " " << ny << std::endl
+       << 255 << std::endl;
+    for (int j = ny - 1; j >= 0; j--) {
+        for (int i = 0; i < nx; i++) {
+            vec3 c = pixel(i, j);
+            for (int k = 0; k < 3; k++)
+                fs << std::min(255, std::max(0, int(255 * c[k]))) << (k < 2 ? " " : "\n");
+        }
+    }
+}
+
+// Writes linear pixels, row j = 0 at the bottom.
+void write_ppm(const std::string& path, const std::vector<vec3>& pixels, int nx, int ny)
+{
+    write_ppm(path, nx, ny, [&](int i, int j) {
+        const vec3& c = pixels[i + nx * j];
+        return vec3(sqrt(std::max(c[0], 0.0f)), sqrt(std::max(c[1], 0.0f)), sqrt(std::max(c[2], 0.0f)));
+    });
+}
+
 int main(int argc, char** argv)
 {
 
@@ -311,8 +476,11 @@ int main(int argc, char** argv)
 
     if (argc != 2) {
         std::cerr << "Usage: ./executable hoge.ppm" << std::endl;
+        std::cerr << "       ./executable --bench" << std::endl;
         return 1;
     }
+    if (std::string(argv[1]) == "--bench")
+        return run_benchmarks();
     std::string ppm_path(argv[1]);
 
     // For show performance
@@ -342,6 +510,21 @@ int main(int argc, char** argv)
     // float vfov = 40.0;
     // camera cam(lookfrom, lookat, vec3(0, 1, 0), vfov, float(nx) / float(ny), aperture, dist_to_focus, 0, 1);
 
+    // hitable* world = cornell_cloud();
+    // vec3 lookfrom(278, 278, -800);
+    // vec3 lookat(278, 278, 0);
+    // float dist_to_focus = 10.0;
+    // float aperture = 0.0;
+    // float vfov = 40.0;
+    // camera cam(lookfrom, lookat, vec3(0, 1, 0), vfov, float(nx) / float(ny), aperture, dist_to_focus, 0, 1);
+
+    // hitable* world = night_street();
+    // vec3 lookfrom(-45, 2.5, 0);
+    // vec3 lookat(0, 4, 0);
+    // float dist_to_focus = (lookfrom - lookat).length();
+    // float aperture = 0.0;
+    // camera cam(lookfrom, lookat, vec3(0, 1, 0), 40, float(nx) / float(ny), aperture, dist_to_focus, 0, 1);
+
     // hitable* world = triangle_test();
     // vec3 lookfrom(12, 2, 3);
     // vec3 lookat(0, 0.5, 0);
@@ -349,6 +532,22 @@ int main(int argc, char** argv)
     // float aperture = 0.0;
     // camera cam(lookfrom, lookat, vec3(0, 1, 0), 40, float(nx) / float(ny), aperture, dist_to_focus, 0, 1);
 
+    // hitable* world = forest_test();
+    // vec3 lookfrom(40, 12, 30);
+    // vec3 lookat(0, 0.5, 0);
+    // float dist_to_focus = (lookfrom - lookat).length();
+    // float aperture = 0.0;
+    // camera cam(lookfrom, lookat, vec3(0, 1, 0), 40, float(nx) / float(ny), aperture, dist_to_focus, 0, 1);
+
+    // Light arriving from far away around the scene, see environment.h. Meant
+    // for outdoor scenes made with sky, like model_test(true).
+    const environment* sky = nullptr;
+    // const environment* sky = environment::load("sky.hdr");
+
+    // Keep model textures block-compressed in memory instead of streaming
+    // their tiles from disk.
+    // image_store::get().texture_storage = image_store::storage::compressed;
+
     hitable* world = model_test();
     vec3 lookfrom(12, 2, 3);
     vec3 lookat(0, 0.5, 0);
@@ -356,8 +555,36 @@ int main(int argc, char** argv)
     float aperture = 0.0;
     camera cam(lookfrom, lookat, vec3(0, 1, 0), 40, float(nx) / float(ny), aperture, dist_to_focus, 0, 1);
 
+    cam.set_image_height(ny);
+
     std::vector<std::vector<vec3>> colors(ny, std::vector<vec3>(nx));
 
+    // Trace each row as one batch of paths shaded per material, see
+    // wavefront.h, instead of one recursive color() call per sample.
+    bool wavefront = false;
+    // With wavefront, sort each bounce's rays and traverse the BVH with
+    // groups of them, see ray_stream.
+    bool ray_streams = true;
+    // Without wavefront, trace the primary rays of a pinhole camera in
+    // packets of 8 pixels x 8 samples, see ray_packet. Off while packets are
+    // no faster than single rays on bench_ray_coherence.
+    bool packets = false;
+    // Without wavefront, sample the emitters at diffuse hits as well, see
+    // light.h. Scenes lit by many small lights converge much faster.
+    bool light_sampling = false;
+    const light_bvh* lights = light_sampling ? new light_bvh(world, sky) : nullptr;
+    // Without wavefront, take the numbers of each path from Owen-scrambled
+    // Sobol points, see sampler.h, rather than independent ones. The samples
+    // of a pixel then cover its area, the lens and the first bounces evenly.
+    bool sobol_sampling = true;
+    // Without wavefront, keep the albedo, normal and depth the camera rays
+    // hit, see denoise.h, and filter the noise out of the image with them
+    // after rendering. The raw render stays in hoge.ppm. The filtered one
+    // and the buffers go next to it, as hoge_denoised.ppm, hoge_albedo.ppm
+    // etc.
+    bool denoising = true;
+    render_buffers buffers(nx, ny);
+
     std::vector<std::thread> threads;
     // int number_of_threads = 1;
     int number_of_threads = std::thread::hardware_concurrency();
@@ -374,20 +601,103 @@ int main(int argc, char** argv)
             pixels_per_threads[i] = y_per_threads[i].size() * nx;
         }
         for (int k = 0; k < y_per_threads.size(); k++) {
-            threads.push_back(std::thread([k, &y_per_threads, &done_pixels_per_threads, &colors, nx, ny, ns, cam, world]() {
+            threads.push_back(std::thread([k, &y_per_threads, &done_pixels_per_threads, &colors, &buffers, nx, ny, ns, cam, world, sky, wavefront, ray_streams, packets, lights, sobol_sampling, denoising]() {
+                sobol_sampler sobol;
+                if (sobol_sampling && !wavefront)
+                    sampler::current = &sobol;
                 auto& q = y_per_threads[k];
                 while(!q.empty()) {
                     int j = q.front();
                     q.pop();
+                    if (wavefront) {
+                        std::vector<wavefront_path> paths(nx * ns);
+                        for (int i = 0; i < nx; i++) {
+                            for (int s = 0; s < ns; s++) {
+                                float u = (i + rand_float() - 0.5f) / nx;
+                                float v = (j + rand_float() - 0.5f) / ny;
+                                paths[i * ns + s].r = cam.get_ray(u, v);
+                                paths[i * ns + s].pixel = i;
+                            }
+                        }
+                        std::vector<vec3> sums(nx, vec3(0, 0, 0));
+                        trace_wavefront(paths, world, sums, ray_streams, sky);
+                        for (int i = 0; i < nx; i++) {
+                            vec3 total_col = sums[i] / float(ns);
+                            colors[j][i] = vec3(sqrt(total_col[0]), sqrt(total_col[1]), sqrt(total_col[2]));
+                        }
+                        done_pixels_per_threads[k] += nx;
+                        continue;
+                    }
+                    if (packets && cam.lens_radius == 0) {
+                        // Pinhole camera, primary rays share the origin. Trace
+                        // 8 pixels x 8 samples as one packet.
+                        ray_packet packet;
+                        // dimensions each ray used, its shading goes on after them
+                        std::vector<int> dimensions;
+                        for (int i0 = 0; i0 < nx; i0 += 8) {
+                            int i1 = std::min(i0 + 8, nx);
+                            std::vector<pixel_sums> sums(i1 - i0);
+                            for (int s0 = 0; s0 < ns; s0 += 8) {
+                                int s1 = std::min(s0 + 8, ns);
+                                packet.clear();
+                                dimensions.clear();
+                                for (int i = i0; i < i1; i++) {
+                                    for (int s = s0; s < s1; s++) {
+                                        if (sampler::current)
+                                            sampler::current->start(i, j, s);
+                                        float u = (i + rand_float() - 0.5f) / nx;
+                                        float v = (j + rand_float() - 0.5f) / ny;
+                                        packet.add(cam.get_ray(u, v));
+                                        if (sampler::current)
+                                            dimensions.push_back(sampler::current->dimension());
+                                    }
+                                }
+                                packet.intersect(world, 0.001, 1e9);
+                                for (int p = 0; p < int(packet.rays.size()); p++) {
+                                    if (sampler::current)
+                                        sampler::current->start(i0 + p / (s1 - s0), j, s0 + p % (s1 - s0), dimensions[p]);
+                                    pixel_sums& pixel = sums[p / (s1 - s0)];
+                                    if (packet.hits[p])
+                                        pixel.add_color(shade(packet.rays[p], packet.infos[p], world, sky, 0, lights));
+                                    else if (sky)
+                                        pixel.add_color(sky->radiance(packet.rays[p].direction()));
+                                    else
+                                        pixel.add_color(vec3(0, 0, 0));
+                                    if (denoising)
+                                        pixel.add_first_hit(packet.rays[p], packet.hits[p] ? &packet.infos[p] : nullptr, world);
+                                }
+                            }
+                            for (int i = i0; i < i1; i++) {
+                                buffers.store(i, j, sums[i - i0], ns);
+                                vec3 total_col = buffers.color[i + nx * j];
+                                colors[j][i] = vec3(sqrt(total_col[0]), sqrt(total_col[1]), sqrt(total_col[2]));
+                                done_pixels_per_threads[k]++;
+                            }
+                        }
+                        continue;
+                    }
                     for (int i = 0; i < nx; i++) {
-                        vec3 total_col(0, 0, 0);
+                        pixel_sums sums;
                         for (int k = 0; k < ns; k++) {
-                            float u = 1.0 * (i + rand_float() - 0.5) / nx;
-                            float v = 1.0 * (j + rand_float() - 0.5) / ny;
+                            if (sampler::current)
+                                sampler::current->start(i, j, k);
+                            float u = (i + rand_float() - 0.5f) / nx;
+                            float v = (j + rand_float() - 0.5f) / ny;
                             ray r = cam.get_ray(u, v);
-                            total_col += color(r, world);
+                            if (!denoising) {
+                                sums.add_color(color(r, world, sky, 0, lights));
+                                continue;
+                            }
+                            hit_info hit;
+                            bool hit_anything = world->hit(r, 0.001, 1e9, hit);
+                            if (hit_anything)
+                                sums.add_color(shade(r, hit, world, sky, 0, lights));
+                            else
+                                sums.add_color(sky ? sky->radiance(r.direction()) : vec3(0, 0, 0));
+                            sums.add_first_hit(r, hit_anything ? &hit : nullptr, world);
                         }
-                        total_col /= float(ns);
+                        buffers.store(i, j, sums, ns);
+                        vec3 total_col = buffers.color[i + nx * j];
                         // gamma ほせい
                         total_col = vec3(sqrt(total_col[0]), sqrt(total_col[1]), sqrt(total_col[2]));
                         colors[j][i] = total_col;
@@ -438,22 +748,7 @@ int main(int argc, char** argv)
             for (int i = 0; i < number_of_threads; i++){
                 done &= pixels_per_threads[i] == done_pixels_per_threads[i];
             }
-            std::fstream fs(ppm_path, std::ios::out | std::ios::trunc);
-            int ny = colors.size();
-            int nx = colors[0].size();
-            fs << "P3" << std::endl
-               << nx << " " << ny << std::endl
-               << 255 << std::endl;
-            for (int j = ny - 1; j >= 0; j--) {
-                for (int i = 0; i < nx; i++) {
-                    vec3 total_col = colors[j][i];
-                    int ir = (int)(255 * total_col.r());
-                    int ig = (int)(255 * total_col.g());
-                    int ib = (int)(255 * total_col.b());
-                    fs << ir << " " << ig << " " << ib << "\n";
-                }
-            }
-            fs.close();
+            write_ppm(ppm_path, colors[0].size(), colors.size(), [&](int i, int j) { return colors[j][i]; });
             if (done)
                 break;
             std::this_thread::sleep_for(std::chrono::seconds(1));
@@ -462,6 +757,31 @@ int main(int argc, char** argv)
     for (auto& t : threads)
         t.join();
 
+    if (denoising && !wavefront) {
+        std::chrono::system_clock::time_point denoise_start = std::chrono::system_clock::now();
+        std::vector<vec3> denoised = atrous_denoiser().denoise(buffers);
+        auto denoise_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - denoise_start).count();
+        std::cerr << "Denoise: " << denoise_ms << " ms" << std::endl;
+
+        std::string stem = ppm_path;
+        if (stem.size() > 4 && stem.substr(stem.size() - 4) == ".ppm")
+            stem.resize(stem.size() - 4);
+        // depths shown grey at the median one, white far away
+        std::vector<float> depths(buffers.depth);
+        std::nth_element(depths.begin(), depths.begin() + depths.size() / 2, depths.end());
+        float median = depths[depths.size() / 2];
+        std::vector<vec3> normal(nx * ny), depth(nx * ny);
+        for (int p = 0; p < nx * ny; p++) {
+            normal[p] = 0.5f * (buffers.normal[p] + vec3(1, 1, 1));
+            float d = buffers.depth[p] / (buffers.depth[p] + median);
+            depth[p] = vec3(d, d, d);
+        }
+        write_ppm(stem + "_denoised.ppm", denoised, nx, ny);
+        write_ppm(stem + "_albedo.ppm", buffers.albedo, nx, ny);
+        write_ppm(stem + "_normal.ppm", normal, nx, ny);
+        write_ppm(stem + "_depth.ppm", depth, nx, ny);
+    }
+
      if (show_performance) {
         std::chrono::system_clock::time_point end  = std::chrono::system_clock::now();
         std::chrono::system_clock::duration dur = end - start;
@@ -471,6 +791,12 @@ int main(int argc, char** argv)
         std::cerr << "Total: " << ms << " ms" << std::endl;
         std::cerr << "Ray:   " << (1/(ms/1000.0)) * nx * ny * ns << " ray/s" << std::endl;
         std::cerr << "Pixel: " << (1/(ms/1000.0)) * nx * ny << " pixel/s" << std::endl;
+        texture_cache& cache = texture_cache::get();
+        if (cache.lookups() > 0) {
+            std::cerr << "Texture cache: " << 100 * cache.hit_rate() << "% hits, "
+                      << cache.bytes_loaded() / (1 << 20) << " MB loaded into a "
+                      << cache.capacity_bytes() / (1 << 20) << " MB cache" << std::endl;
+        }
      }
      return 0;
 }
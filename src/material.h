@@ -18,7 +18,7 @@ bool refract(const vec3& v, const vec3& n, float ni_over_nt, vec3& refracted)
 {
     vec3 uv = unit_vector(v);
     float dt = dot(uv, n);
-    float discriminant = 1.0 - ni_over_nt * ni_over_nt * (1-dt*dt);
+    float discriminant = 1 - ni_over_nt * ni_over_nt * (1-dt*dt);
     if (discriminant > 0) {
         refracted = ni_over_nt * (uv - n * dt) - n * sqrt(discriminant);
         return true;
@@ -33,29 +33,77 @@ float schlick(float cosine, float ref_idx)
     return r0 + (1-r0) * pow(1-cosine, 5);
 }
 
+// Concrete type of a material, so the wavefront renderer can bin hits and
+// shade each bin with direct calls. Materials defined elsewhere are
+// generic and shaded through the virtual functions.
+enum class material_kind {
+    generic,
+    lambertian,
+    metal,
+    dielectric,
+    diffuse_light,
+    isotropic,
+    custom,
+};
+
 class material {
 public:
+    material(material_kind k = material_kind::generic) : kind(k) { }
     virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const = 0;
     virtual vec3 emitted(float u, float v, const vec3& p) const { return vec3(0, 0, 0); }
+    // The light scatter() sends out along direction per unit of light
+    // arriving back along it: the BRDF times the cosine at rec, or the
+    // phase function, including the attenuation. pdf is the density of
+    // scatter() picking direction. For sampling lights. Returns false if
+    // scatter() only picks single directions, like mirrors and glass do.
+    virtual bool scattering(const ray& r_in, const hit_record& rec, const vec3& direction, vec3& value, float& pdf) const { return false; }
+    // Color of the surface at rec, without lighting, for the denoiser to
+    // tell texture from noise. White for glass.
+    virtual vec3 albedo_at(const hit_record& rec) const { return vec3(1, 1, 1); }
+    // True if scatter() sends each ray on in one direction, like a mirror
+    // or glass, so what it shows is somewhere else.
+    virtual bool specular() const { return false; }
+    const material_kind kind;
 };
 
+vec3 emission(const material* mat, float u, float v, const vec3& p)
+{
+    return mat ? mat->emitted(u, v, p) : vec3(0, 0, 0);
+}
+
+// Lambertian BRDF times cosine for direction, 0 below the surface, with
+// the density of cosine weighted scattering.
+inline vec3 diffuse_scattering(const hit_record& rec, const vec3& direction, const vec3& albedo, float& pdf)
+{
+    pdf = std::max(dot(rec.normal, unit_vector(direction)), 0.0f) / float(M_PI);
+    return albedo * pdf;
+}
+
 class lambertian : public material {
 public:
-    lambertian(texture* a) : albedo(a) {}
+    lambertian(texture* a) : material(material_kind::lambertian), albedo(a) {}
     bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const override
     {
-        vec3 target = rec.p + rec.normal + random_in_unit_sphere();
-        scattered = ray(rec.p, target-rec.p);
-        attenuation = albedo->value(rec.u, rec.v, rec.p);
+        scattered = ray(rec.p, random_cosine_direction(rec.normal));
+        attenuation = albedo->filtered_value(rec.u, rec.v, rec.p, rec.footprint);
+        return true;
+    }
+    bool scattering(const ray& r_in, const hit_record& rec, const vec3& direction, vec3& value, float& pdf) const override
+    {
+        value = diffuse_scattering(rec, direction, albedo->filtered_value(rec.u, rec.v, rec.p, rec.footprint), pdf);
         return true;
     }
+    vec3 albedo_at(const hit_record& rec) const override
+    {
+        return albedo->filtered_value(rec.u, rec.v, rec.p, rec.footprint);
+    }
 
     texture* albedo;
 };
 
 class metal : public material {
 public:
-    metal(const vec3& a, float f) : albedo(a), fuzz(std::min(1.0f, f)) {}
+    metal(const vec3& a, float f) : material(material_kind::metal), albedo(a), fuzz(std::min(1.0f, f)) {}
     bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const override
     {
         vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
@@ -63,19 +111,24 @@ public:
         attenuation = albedo;
         return dot(scattered.direction(), rec.normal) > 0;
     }
+    vec3 albedo_at(const hit_record& rec) const override
+    {
+        return albedo;
+    }
+    bool specular() const override { return fuzz == 0; }
     vec3 albedo;
     float fuzz;
 };
 
 class dielectric : public material {
 public:
-    dielectric(float ri) : ref_idx(ri) {}
+    dielectric(float ri) : material(material_kind::dielectric), ref_idx(ri) {}
     bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const override
     {
         vec3 outward_normal;
         vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
         float ni_over_nt;
-        attenuation = vec3(1.0, 1.0, 1.0);
+        attenuation = vec3(1, 1, 1);
         vec3 refracted;
         float reflect_prob;
         float cosine;
@@ -85,14 +138,14 @@ public:
             cosine = ref_idx * dot(r_in.direction(), rec.normal) / r_in.direction().length();
         } else {
             outward_normal = rec.normal;
-            ni_over_nt = 1.0 / ref_idx;
+            ni_over_nt = 1 / ref_idx;
             cosine = -dot(r_in.direction(), rec.normal) / r_in.direction().length();
         }
         if (refract(r_in.direction(), outward_normal, ni_over_nt, refracted)) {
             // scattered = ray(rec.p, refracted);
             reflect_prob = schlick(cosine, ref_idx);
         } else {
-            reflect_prob = 1.0;
+            reflect_prob = 1;
         }
         if (rand_float() < reflect_prob) {
             scattered = ray(rec.p, reflected, r_in.time());
@@ -101,65 +154,73 @@ public:
         }
         return true;
     }
+    bool specular() const override { return true; }
 
     float ref_idx;
 };
 
 class diffuse_light : public material {
 public:
-    diffuse_light(texture* a) : emit(a) { }
+    diffuse_light(texture* a) : material(material_kind::diffuse_light), emit(a) { }
     bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const {
         return false;
     }
     vec3 emitted(float u, float v, const vec3& p) const {
         return emit->value(u, v, p);
     }
+    // lights reflect nothing
+    vec3 albedo_at(const hit_record& rec) const {
+        return vec3(0, 0, 0);
+    }
     texture* emit;
 };
 
 class isotropic : public material {
 public:
-    isotropic(texture* a) : albedo(a) { }
+    isotropic(texture* a) : material(material_kind::isotropic), albedo(a) { }
     bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const {
-        scattered = ray(rec.p, random_in_unit_sphere());
+        scattered = ray(rec.p, random_unit_vector());
         attenuation = albedo->value(rec.u, rec.v, rec.p);
         return true;
     }
+    bool scattering(const ray& r_in, const hit_record& rec, const vec3& direction, vec3& value, float& pdf) const {
+        pdf = float(1 / (4 * M_PI));
+        value = albedo->value(rec.u, rec.v, rec.p) * pdf;
+        return true;
+    }
+    vec3 albedo_at(const hit_record& rec) const {
+        return albedo->value(rec.u, rec.v, rec.p);
+    }
 
     texture* albedo;
 };
 
 class custom_material : public material {
 public:
-    // Copy obj_material in case of it's allocated in stack
-    custom_material(obj_material mat) : obj_mat(mat) { }
+    // Copy obj_material in case of it's allocated in stack. The texture is
+    // shared, not copied.
+    custom_material(obj_material mat) : material(material_kind::custom), obj_mat(mat) { }
     bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const {
         attenuation = obj_mat.diffuse;
-        vec3 target = rec.p + rec.normal + random_in_unit_sphere();
-        scattered = ray(rec.p, target-rec.p);
+        scattered = ray(rec.p, random_cosine_direction(rec.normal));
 
         // read texture
-        if (obj_mat.tex_color.size() > 0) {
-            int nx = obj_mat.tex_width;
-            int ny = obj_mat.tex_height;
-            int x = obj_mat.tex_width * rec.u;
-            int y = (1 - rec.v) * ny - 0.001;
-            x = std::clamp(x, 0, nx - 1);
-            y = std::clamp(y, 0, ny - 1);
-            // std::cerr << "x = " << x << " y = " << y << " nx = " << nx << " ny = " << ny << std::endl;
-
-            float r = int(obj_mat.tex_color[4 * x + 4 * nx * y + 0]) / 255.0;
-            float g = int(obj_mat.tex_color[4 * x + 4 * nx * y + 1]) / 255.0;
-            float b = int(obj_mat.tex_color[4 * x + 4 * nx * y + 2]) / 255.0;
-            float a = int(obj_mat.tex_color[4 * x + 4 * nx * y + 3]) / 255.0;
-            // std::cerr << r << " " << g << " " << b << " " << a << std::endl;
-            attenuation = vec3(r, g, b);
+        if (obj_mat.tex_color) {
+            attenuation = obj_mat.tex_color->sample(rec.u, rec.v, rec.footprint);
             // if (a < 0.99)
             //     return false;
 
         }
         return true;
     }
+    bool scattering(const ray& r_in, const hit_record& rec, const vec3& direction, vec3& value, float& pdf) const {
+        vec3 albedo = obj_mat.tex_color ? obj_mat.tex_color->sample(rec.u, rec.v, rec.footprint) : obj_mat.diffuse;
+        value = diffuse_scattering(rec, direction, albedo, pdf);
+        return true;
+    }
+    vec3 albedo_at(const hit_record& rec) const {
+        return obj_mat.tex_color ? obj_mat.tex_color->sample(rec.u, rec.v, rec.footprint) : obj_mat.diffuse;
+    }
     vec3 emitted(float u, float v, const vec3& p) const {
         return obj_mat.emissive_coefficient;
     }
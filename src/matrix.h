@@ -0,0 +1,110 @@
+#pragma once
+
+#include "vec3.h"
+
+#include <cmath>
+
+// 3x4 affine transform. The last column is translation.
+class mat34 {
+public:
+    mat34() {
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 4; j++)
+                m[i][j] = i == j ? 1 : 0;
+    }
+
+    static mat34 translation(const vec3& d) {
+        mat34 r;
+        r.m[0][3] = d.x();
+        r.m[1][3] = d.y();
+        r.m[2][3] = d.z();
+        return r;
+    }
+
+    static mat34 scaling(const vec3& s) {
+        mat34 r;
+        r.m[0][0] = s.x();
+        r.m[1][1] = s.y();
+        r.m[2][2] = s.z();
+        return r;
+    }
+
+    // Rodrigues' rotation around axis, angle in degrees
+    static mat34 rotation(const vec3& axis, float angle) {
+        float radians = (M_PI / 180.0) * angle;
+        float s = sin(radians);
+        float c = cos(radians);
+        vec3 a = unit_vector(axis);
+        mat34 r;
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                r.m[i][j] = a[i] * a[j] * (1 - c) + (i == j ? c : 0);
+        r.m[0][1] -= a.z() * s;
+        r.m[0][2] += a.y() * s;
+        r.m[1][0] += a.z() * s;
+        r.m[1][2] -= a.x() * s;
+        r.m[2][0] -= a.y() * s;
+        r.m[2][1] += a.x() * s;
+        return r;
+    }
+
+    vec3 point(const vec3& p) const {
+        return vec3(m[0][0] * p[0] + m[0][1] * p[1] + m[0][2] * p[2] + m[0][3],
+                    m[1][0] * p[0] + m[1][1] * p[1] + m[1][2] * p[2] + m[1][3],
+                    m[2][0] * p[0] + m[2][1] * p[1] + m[2][2] * p[2] + m[2][3]);
+    }
+
+    vec3 vector(const vec3& v) const {
+        return vec3(m[0][0] * v[0] + m[0][1] * v[1] + m[0][2] * v[2],
+                    m[1][0] * v[0] + m[1][1] * v[1] + m[1][2] * v[2],
+                    m[2][0] * v[0] + m[2][1] * v[1] + m[2][2] * v[2]);
+    }
+
+    // Multiplies by the transposed linear part. Normals are transformed by
+    // the transposed inverse, so call this on the inverse matrix.
+    vec3 transposed_vector(const vec3& v) const {
+        return vec3(m[0][0] * v[0] + m[1][0] * v[1] + m[2][0] * v[2],
+                    m[0][1] * v[0] + m[1][1] * v[1] + m[2][1] * v[2],
+                    m[0][2] * v[0] + m[1][2] * v[1] + m[2][2] * v[2]);
+    }
+
+    mat34 inverse() const {
+        // inverse of linear part by cofactors, then translation
+        float det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+                  - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+                  + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+        float inv_det = 1.0 / det;
+        mat34 r;
+        r.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv_det;
+        r.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+        r.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+        r.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * inv_det;
+        r.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+        r.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+        r.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv_det;
+        r.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+        r.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+        vec3 t = r.vector(vec3(m[0][3], m[1][3], m[2][3]));
+        r.m[0][3] = -t.x();
+        r.m[1][3] = -t.y();
+        r.m[2][3] = -t.z();
+        return r;
+    }
+
+    float m[3][4];
+};
+
+// Applies right first, then left
+inline mat34 operator*(const mat34& left, const mat34& right)
+{
+    mat34 r;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            r.m[i][j] = left.m[i][0] * right.m[0][j]
+                      + left.m[i][1] * right.m[1][j]
+                      + left.m[i][2] * right.m[2][j];
+        }
+        r.m[i][3] += left.m[i][3];
+    }
+    return r;
+}
@@ -16,8 +16,10 @@ public:
                      time1(t1),
                      radius(r),
                      mat_ptr(mat) { }
-    bool hit(const ray& r, float tmin, float tmax, hit_record& rec) const override;
+    bool hit(const ray& r, float tmin, float tmax, hit_info& hit) const override;
     bool bounding_box(float t0, float t1, aabb& box) const override;
+    void surface(const ray& r, const hit_info& hit, hit_record& rec) const override;
+    bool hit_interval(const ray& r, float t_min, float t_max, float& t_enter, float& t_exit) const override;
 
     vec3 center(float time) const;
     vec3 center0, center1;
@@ -31,11 +33,11 @@ vec3 moving_sphere::center(float time) const
     return center0 + ((time - time0) / (time1-time0)) * (center1 - center0);
 }
 
-bool moving_sphere::hit(const ray& r, float tmin, float tmax, hit_record& rec) const
+bool moving_sphere::hit(const ray& r, float tmin, float tmax, hit_info& hit) const
 {
     vec3 oc = r.origin() - center(r.time());
     float a = dot(r.direction(), r.direction());
-    float b = 2.0 * dot(oc, r.direction());
+    float b = 2 * dot(oc, r.direction());
     float c = dot(oc, oc) - radius * radius;
     float discriminant = b*b - 4*a*c;
 
@@ -44,24 +46,46 @@ bool moving_sphere::hit(const ray& r, float tmin, float tmax, hit_record& rec) c
         float t2 = (-b + sqrt(discriminant)) / (2*a);
 
         if (tmin < t1 && t1 < tmax) {
-            rec.t = t1;
-            rec.p = r.point_at_parameter(t1);
-            rec.normal = (rec.p - center(r.time())) / radius;
-            rec.mat_ptr = mat_ptr;
-            get_sphere_uv((rec.p - center(r.time())) / radius, rec.u, rec.v);
+            hit.t = t1;
+            hit.obj = this;
+            hit.wrappers = 0;
             return true;
         } else if(tmin < t2 && t2 < tmax) {
-            rec.t = t2;
-            rec.p = r.point_at_parameter(t2);
-            rec.normal = (rec.p - center(r.time())) / radius;
-            rec.mat_ptr = mat_ptr;
-            get_sphere_uv((rec.p - center(r.time())) / radius, rec.u, rec.v);
+            hit.t = t2;
+            hit.obj = this;
+            hit.wrappers = 0;
             return true;
         }
     }
     return false;
 }
 
+// Both roots of the quadratic in hit(), clipped.
+bool moving_sphere::hit_interval(const ray& r, float t_min, float t_max, float& t_enter, float& t_exit) const
+{
+    vec3 oc = r.origin() - center(r.time());
+    float a = dot(r.direction(), r.direction());
+    float b = 2 * dot(oc, r.direction());
+    float c = dot(oc, oc) - radius * radius;
+    float discriminant = b*b - 4*a*c;
+    if (discriminant <= 0)
+        return false;
+    float t1 = (-b - sqrt(discriminant)) / (2*a);
+    float t2 = (-b + sqrt(discriminant)) / (2*a);
+    t_enter = std::max(t1, t_min);
+    t_exit = std::min(t2, t_max);
+    return t_enter < t_exit;
+}
+
+void moving_sphere::surface(const ray& r, const hit_info& hit, hit_record& rec) const
+{
+    rec.p = r.point_at_parameter(rec.t);
+    rec.normal = (rec.p - center(r.time())) / radius;
+    rec.mat_ptr = mat_ptr;
+    get_sphere_uv(rec.normal, rec.u, rec.v);
+    rec.uv_scale = 1 / (float(M_SQRT2 * M_PI) * radius);
+}
+
 bool moving_sphere::bounding_box(float t0, float t1, aabb& box) const
 {
     aabb a0, a1;
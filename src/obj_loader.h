@@ -1,5 +1,7 @@
 #pragma once
 
+#include "image_store.h"
+
 #include <string>
 #include <fstream>
 #include <filesystem>
@@ -17,9 +19,7 @@ struct obj_material {
     float shiness              { 1.0 };           // ni
     float dissolved            { 1.0 };           // d, Tr
     int illum                  { 0 };             // illum
-    std::vector<unsigned char> tex_color;         // Kd
-    int tex_width { 0 };
-    int tex_height { 0 };
+    std::shared_ptr<const mipmapped_image> tex_color; // map_Kd, shared via image_store
 };
 
 struct face {
@@ -189,30 +189,10 @@ bool load_mtl(const std::string& path, std::vector<obj_material>& materials)
                 std::cerr << "Format not supported: " << s << std::endl;
                 return false;
             }
-            int nx, ny, nn;
-            unsigned char* tex_data = stbi_load(v[1].c_str(), &nx, &ny, &nn, STBI_rgb_alpha);
-            if (!tex_data) {
-                std::cerr << "Failed to open: " << v[1] << std::endl;
+            std::shared_ptr<const mipmapped_image> tex = image_store::get().load_texture(v[1]);
+            if (!tex)
                 continue;
-            }
-            std::vector<unsigned char> data(4 * nx * ny, 231);
-            // for (int x = 0; x < nx; x++) {
-            //     for (int y = 0; y < ny; y++) {
-            //         data[4 * x + 4 * nx * y + 0] = tex_data[4 * x + 4 * nx * y + 0];
-            //         data[4 * x + 4 * nx * y + 1] = tex_data[4 * x + 4 * nx * y + 1];
-            //         data[4 * x + 4 * nx * y + 2] = tex_data[4 * x + 4 * nx * y + 2];
-            //         data[4 * x + 4 * nx * y + 3] = 123;
-            //     }
-            // }
-            // for (int i = 0; i < data.size(); i++) {
-            //     std::cerr << int(data[i]) << " ";
-            // }
-            // std::cerr << std::endl;
-            std::copy(tex_data, tex_data + 4 * nx * ny, data.begin());
-            last_material.value().tex_color = data;
-            last_material.value().tex_width = nx;
-            last_material.value().tex_height = ny;
-            free(tex_data);
+            last_material.value().tex_color = tex;
         } else {
             std::cerr << "Unknown: " << s << std::endl;
         }
@@ -262,7 +242,7 @@ bool load_obj(const std::string& path, model& model)
         } else if (v[0] == "vt") {
             vec3 tex_coord(std::stof(v[1]), std::stof(v[2]), 0);
             if (v.size() >= 4)
-                tex_coord[3] = std::stof(v[3]);
+                tex_coord[2] = std::stof(v[3]);
             model.tex_coords.push_back(tex_coord);
         } else if (v[0] == "f") {
             // face
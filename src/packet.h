@@ -0,0 +1,178 @@
+#pragma once
+
+#include "bvh.h"
+#include "hitable.h"
+#include "hitable_list.h"
+#include "ray.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Rays from one origin, such as the primary rays of a tile from a pinhole
+// camera, traced together. The packet walks the bvh_node tree as a whole:
+// a node is culled for all rays at once when its box is outside the frustum
+// bounding the rays, and otherwise only the rays hitting its box go on.
+// When fewer than min_coherent rays are left, they continue one by one.
+// Lists, like the one around most scenes, are descended into, and other
+// objects are culled by their bounding box and traced ray by ray.
+class ray_packet {
+public:
+    static const int min_coherent = 4;
+
+    void clear() {
+        rays.clear();
+    }
+
+    void add(const ray& r) {
+        rays.push_back(r);
+    }
+
+    // Finds the closest hit of every ray in (t_min, t_max). Sets hits[i] and
+    // infos[i] like hit() would for rays[i].
+    void intersect(const hitable* world, float t_min, float t_max) {
+        int n = rays.size();
+        infos.assign(n, hit_info());
+        hits.assign(n, 0);
+        tmax.assign(n, t_max);
+        tmin = t_min;
+        if (!make_frustum()) {
+            for (int i = 0; i < n; i++)
+                hits[i] = world->hit(rays[i], t_min, t_max, infos[i]);
+            return;
+        }
+        active.clear();
+        for (int i = 0; i < n; i++)
+            active.push_back(i);
+        descend(world, 0, n);
+    }
+
+    std::vector<ray> rays;
+    std::vector<hit_info> infos;
+    std::vector<char> hits;
+
+    // nodes skipped by the frustum test alone
+    int64_t frustum_culls = 0;
+    // nodes where the packet diverged and rays went on one by one
+    int64_t divergences = 0;
+
+private:
+    // Builds planes through the shared origin enclosing every direction.
+    // Returns false if the rays do not share an origin or spread over more
+    // than a hemisphere.
+    bool make_frustum() {
+        origin = rays[0].origin();
+        vec3 mean(0, 0, 0);
+        for (const ray& r : rays) {
+            if (r.origin()[0] != origin[0] || r.origin()[1] != origin[1] || r.origin()[2] != origin[2])
+                return false;
+            mean += unit_vector(r.direction());
+        }
+        if (mean.length() == 0)
+            return false;
+        vec3 d = unit_vector(mean);
+        vec3 a = fabs(d.x()) > 0.9f ? vec3(0, 1, 0) : vec3(1, 0, 0);
+        vec3 u = unit_vector(cross(a, d));
+        vec3 v = cross(d, u);
+        // bounds of the directions projected to the plane at distance 1
+        float u0 = 1e30, u1 = -1e30, v0 = 1e30, v1 = -1e30;
+        for (const ray& r : rays) {
+            float z = dot(r.direction(), d);
+            if (z <= 0)
+                return false;
+            float x = dot(r.direction(), u) / z;
+            float y = dot(r.direction(), v) / z;
+            u0 = std::min(u0, x);
+            u1 = std::max(u1, x);
+            v0 = std::min(v0, y);
+            v1 = std::max(v1, y);
+        }
+        vec3 corners[4] = { d + u0 * u + v0 * v, d + u1 * u + v0 * v, d + u1 * u + v1 * v, d + u0 * u + v1 * v };
+        for (int i = 0; i < 4; i++)
+            planes[i] = cross(corners[i], corners[(i + 1) % 4]);
+        return true;
+    }
+
+    // True if box is entirely on the outer side of a frustum plane.
+    bool outside_frustum(const aabb& box) const {
+        for (const vec3& n : planes) {
+            // the corner furthest along the inner normal
+            vec3 p(n.x() > 0 ? box.max().x() : box.min().x(),
+                   n.y() > 0 ? box.max().y() : box.min().y(),
+                   n.z() > 0 ? box.max().z() : box.min().z());
+            if (dot(n, p - origin) < 0)
+                return true;
+        }
+        return false;
+    }
+
+    // Rays entering node are active[first, first + count). Survivors are
+    // appended behind them and dropped on return.
+    void traverse(const bvh_node* node, int first, int count) {
+        if (outside_frustum(node->box)) {
+            frustum_culls++;
+            return;
+        }
+        int begin = active.size();
+        for (int k = first; k < first + count; k++) {
+            int i = active[k];
+            if (node->box.hit(rays[i], tmin, tmax[i]))
+                active.push_back(i);
+        }
+        int survivors = active.size() - begin;
+        if (survivors > 0) {
+            if (survivors < min_coherent) {
+                divergences++;
+                for (int k = begin; k < begin + survivors; k++)
+                    trace_single(node, active[k]);
+            } else {
+                visit(node->left, node->leaf, begin, survivors);
+                if (node->right != node->left)
+                    visit(node->right, node->leaf, begin, survivors);
+            }
+        }
+        active.resize(begin);
+    }
+
+    void visit(const hitable* child, bool leaf, int first, int count) {
+        if (leaf)
+            descend(child, first, count);
+        else
+            traverse(static_cast<const bvh_node*>(child), first, count);
+    }
+
+    // Rays active[first, first + count) entering h, of any kind.
+    void descend(const hitable* h, int first, int count) {
+        if (const bvh_node* node = dynamic_cast<const bvh_node*>(h)) {
+            traverse(node, first, count);
+            return;
+        }
+        if (const hitable_list* list = dynamic_cast<const hitable_list*>(h)) {
+            for (int i = 0; i < list->list_size; i++)
+                descend(list->list[i], first, count);
+            return;
+        }
+        aabb box;
+        if (h->bounding_box(0, 1, box) && outside_frustum(box)) {
+            frustum_culls++;
+            return;
+        }
+        for (int k = first; k < first + count; k++)
+            trace_single(h, active[k]);
+    }
+
+    void trace_single(const hitable* h, int i) {
+        if (h->hit(rays[i], tmin, tmax[i], infos[i])) {
+            hits[i] = 1;
+            tmax[i] = infos[i].t;
+        }
+    }
+
+    vec3 origin;
+    // inner normals of the side planes, all through origin
+    vec3 planes[4];
+    float tmin = 0;
+    std::vector<float> tmax;
+    std::vector<int> active;
+};
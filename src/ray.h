@@ -11,7 +11,22 @@ public:
     vec3 direction() const { return B; }
     float time() const { return t; }
     vec3 point_at_parameter(float t) const { return A + t * B; }
+
+    // Same ray in another coordinate system, keeping time and footprint.
+    ray transformed(const vec3& a, const vec3& b) const {
+        ray r = *this;
+        r.A = a;
+        r.B = b;
+        return r;
+    }
+
+    // Width of the ray cone at parameter t, used to filter textures.
+    float footprint(float t) const { return cone_width + cone_spread * t * B.length(); }
+
     vec3 A;
     vec3 B;
     float t;
+    // cone width at the origin and its growth per unit distance
+    float cone_width = 0;
+    float cone_spread = 0;
 };
@@ -1,13 +1,30 @@
 #pragma once
 
 #include "hitable.h"
+#include "hitable_list.h"
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+// Appends the rect corner + s * edge_u + t * edge_v, with s, t in [0, 1], as
+// two emitters if mat emits at its center. Rects are seen from both sides.
+inline void rect_emitters(std::vector<emitter>& out, const vec3& corner, const vec3& edge_u, const vec3& edge_v, const material* mat, const hitable* prim)
+{
+    vec3 radiance = emission(mat, 0.5, 0.5, corner + 0.5 * (edge_u + edge_v));
+    if (max_component(radiance) <= 0)
+        return;
+    vec3 opposite = corner + edge_u + edge_v;
+    out.push_back({ corner, corner + edge_u, opposite, radiance, true, prim, prim });
+    out.push_back({ corner, opposite, corner + edge_v, radiance, true, prim, prim });
+}
 
 class xy_rect : public hitable {
 public:
     xy_rect(float _x0, float _x1, float _y0, float _y1, float _z, material* mat)
         : x0(_x0), x1(_x1), y0(_y0), y1(_y1), z(_z), mat_ptr(mat) { }
 
-    bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    bool hit(const ray& r, float t_min, float t_max, hit_info& hit) const {
         float t = (z - r.origin().z()) / r.direction().z();
         if (t < t_min || t_max < t)
             return false;
@@ -16,13 +33,19 @@ public:
         if (x < x0 || x1 < x || y < y0 || y1 < y)
             return false;
 
-        rec.u = (x - x0) / (x1 - x0);
-        rec.v = (y - y0) / (y1 - y0);
-        rec.t = t;
+        hit.t = t;
+        hit.obj = this;
+        hit.wrappers = 0;
+        return true;
+    }
+
+    void surface(const ray& r, const hit_info& hit, hit_record& rec) const {
+        rec.p = r.point_at_parameter(rec.t);
+        rec.u = (rec.p.x() - x0) / (x1 - x0);
+        rec.v = (rec.p.y() - y0) / (y1 - y0);
+        rec.uv_scale = 1 / sqrt((x1 - x0) * (y1 - y0));
         rec.mat_ptr = mat_ptr;
-        rec.p = r.point_at_parameter(t);
         rec.normal = vec3(0, 0, 1);
-        return true;
     }
 
     bool bounding_box(float t0, float t1, aabb& box) const {
@@ -30,6 +53,15 @@ public:
         return true;
     }
 
+    bool point_at_uv(float u, float v, vec3& p) const {
+        p = vec3(x0 + u * (x1 - x0), y0 + v * (y1 - y0), z);
+        return true;
+    }
+
+    void emitters(std::vector<emitter>& out) const {
+        rect_emitters(out, vec3(x0, y0, z), vec3(x1 - x0, 0, 0), vec3(0, y1 - y0, 0), mat_ptr, this);
+    }
+
     material* mat_ptr;
     float x0, y0, x1, y1, z;
 };
@@ -39,7 +71,7 @@ public:
     xz_rect(float _x0, float _x1, float _z0, float _z1, float _y, material* mat)
         : x0(_x0), z0(_z0), x1(_x1), z1(_z1), y(_y), mat_ptr(mat) { }
 
-    bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    bool hit(const ray& r, float t_min, float t_max, hit_info& hit) const {
         float t = (y - r.origin().y()) / r.direction().y();
         if (t < t_min || t_max < t)
             return false;
@@ -48,13 +80,19 @@ public:
         if (x < x0 || x1 < x || z < z0 || z1 < z)
             return false;
 
-        rec.u = (x - x0) / (x1 - x0);
-        rec.v = (z - z0) / (z1 - z0);
-        rec.t = t;
+        hit.t = t;
+        hit.obj = this;
+        hit.wrappers = 0;
+        return true;
+    }
+
+    void surface(const ray& r, const hit_info& hit, hit_record& rec) const {
+        rec.p = r.point_at_parameter(rec.t);
+        rec.u = (rec.p.x() - x0) / (x1 - x0);
+        rec.v = (rec.p.z() - z0) / (z1 - z0);
+        rec.uv_scale = 1 / sqrt((x1 - x0) * (z1 - z0));
         rec.mat_ptr = mat_ptr;
-        rec.p = r.point_at_parameter(t);
         rec.normal = vec3(0, 1, 0);
-        return true;
     }
 
     bool bounding_box(float t0, float t1, aabb& box) const {
@@ -62,6 +100,15 @@ public:
         return true;
     }
 
+    bool point_at_uv(float u, float v, vec3& p) const {
+        p = vec3(x0 + u * (x1 - x0), y, z0 + v * (z1 - z0));
+        return true;
+    }
+
+    void emitters(std::vector<emitter>& out) const {
+        rect_emitters(out, vec3(x0, y, z0), vec3(x1 - x0, 0, 0), vec3(0, 0, z1 - z0), mat_ptr, this);
+    }
+
     material* mat_ptr;
     float x0, z0, x1, z1, y;
 };
@@ -71,7 +118,7 @@ public:
     yz_rect(float _y0, float _y1, float _z0, float _z1, float _x, material* mat)
         : y0(_y0), z0(_z0), y1(_y1), z1(_z1), x(_x), mat_ptr(mat) { }
 
-    bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    bool hit(const ray& r, float t_min, float t_max, hit_info& hit) const {
         float t = (x - r.origin().x()) / r.direction().x();
         if (t < t_min || t_max < t)
             return false;
@@ -80,13 +127,19 @@ public:
         if (y < y0 || y1 < y || z < z0 || z1 < z)
             return false;
 
-        rec.u = (y - y0) / (y1 - y0);
-        rec.v = (z - z0) / (z1 - z0);
-        rec.t = t;
+        hit.t = t;
+        hit.obj = this;
+        hit.wrappers = 0;
+        return true;
+    }
+
+    void surface(const ray& r, const hit_info& hit, hit_record& rec) const {
+        rec.p = r.point_at_parameter(rec.t);
+        rec.u = (rec.p.y() - y0) / (y1 - y0);
+        rec.v = (rec.p.z() - z0) / (z1 - z0);
+        rec.uv_scale = 1 / sqrt((y1 - y0) * (z1 - z0));
         rec.mat_ptr = mat_ptr;
-        rec.p = r.point_at_parameter(t);
         rec.normal = vec3(1, 0, 0);
-        return true;
     }
 
     bool bounding_box(float t0, float t1, aabb& box) const {
@@ -94,25 +147,99 @@ public:
         return true;
     }
 
+    bool point_at_uv(float u, float v, vec3& p) const {
+        p = vec3(x, y0 + u * (y1 - y0), z0 + v * (z1 - z0));
+        return true;
+    }
+
+    void emitters(std::vector<emitter>& out) const {
+        rect_emitters(out, vec3(x, y0, z0), vec3(0, y1 - y0, 0), vec3(0, 0, z1 - z0), mat_ptr, this);
+    }
+
     material* mat_ptr;
     float y0, z0, y1, z1, x;
 };
 
+// Axis-aligned box, intersected by one slab test. The face hit and its
+// normal follow from the axis where the ray enters or, from inside, leaves.
+// Faces are numbered like the rects they replace: -z, +z, -y, +y, -x, +x.
+// Boxes whose faces have different materials keep a list of six rects.
 class box : public hitable {
 public:
-    box(const vec3& p0, const vec3& p1, material* mat) : pmin(p0), pmax(p1), mat_ptr(mat) {
+    box(const vec3& p0, const vec3& p1, material* mat) : pmin(p0), pmax(p1), mat_ptr(mat) { }
+
+    box(const vec3& p0, const vec3& p1, material* const faces[6]) : pmin(p0), pmax(p1), mat_ptr(faces[0]) {
+        if (std::all_of(faces, faces + 6, [faces](material* m) { return m == faces[0]; }))
+            return;
         hitable** list = new hitable*[6];
-        list[0] = new flip_normals(new xy_rect(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), mat));
-        list[1] = new xy_rect(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), mat);
-        list[2] = new flip_normals(new xz_rect(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), mat));
-        list[3] = new xz_rect(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), mat);
-        list[4] = new flip_normals(new yz_rect(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), mat));
-        list[5] = new yz_rect(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), mat);
+        list[0] = new flip_normals(new xy_rect(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), faces[0]));
+        list[1] = new xy_rect(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), faces[1]);
+        list[2] = new flip_normals(new xz_rect(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), faces[2]));
+        list[3] = new xz_rect(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), faces[3]);
+        list[4] = new flip_normals(new yz_rect(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), faces[4]));
+        list[5] = new yz_rect(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), faces[5]);
         list_ptr = new hitable_list(list, 6);
     }
 
-    bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
-        return list_ptr->hit(r, t_min, t_max, rec);
+    bool hit(const ray& r, float t_min, float t_max, hit_info& hit) const {
+        if (list_ptr)
+            return list_ptr->hit(r, t_min, t_max, hit);
+        // Faces are closed like rects, so a ray along an edge still hits.
+        float t_enter = std::numeric_limits<float>::lowest();
+        float t_exit = std::numeric_limits<float>::max();
+        int enter_face = 0, exit_face = 0;
+        for (int a = 0; a < 3; a++) {
+            float t0 = (pmin[a] - r.origin()[a]) / r.direction()[a];
+            float t1 = (pmax[a] - r.origin()[a]) / r.direction()[a];
+            int f0 = 4 - 2 * a;
+            int f1 = f0 + 1;
+            if (t0 > t1) {
+                std::swap(t0, t1);
+                std::swap(f0, f1);
+            }
+            // NaN, when the origin lies on a slab plane parallel to the
+            // ray, fails both tests and the axis is ignored
+            if (t0 > t_enter) {
+                t_enter = t0;
+                enter_face = f0;
+            }
+            if (t1 < t_exit) {
+                t_exit = t1;
+                exit_face = f1;
+            }
+        }
+        if (t_enter > t_exit)
+            return false;
+        if (t_min <= t_enter && t_enter <= t_max) {
+            hit.t = t_enter;
+            hit.u = enter_face;
+        } else if (t_min <= t_exit && t_exit <= t_max) {
+            hit.t = t_exit;
+            hit.u = exit_face;
+        } else {
+            return false;
+        }
+        hit.obj = this;
+        hit.wrappers = 0;
+        return true;
+    }
+
+    // hit.u holds the face
+    void surface(const ray& r, const hit_info& hit, hit_record& rec) const {
+        int face = int(hit.u);
+        int a = 2 - face / 2;
+        // the other two axes in the order the rects use for u and v
+        int ua = a == 0 ? 1 : 0;
+        int va = a == 2 ? 1 : 2;
+        vec3 extent = pmax - pmin;
+        rec.p = r.point_at_parameter(hit.t);
+        rec.u = (rec.p[ua] - pmin[ua]) / extent[ua];
+        rec.v = (rec.p[va] - pmin[va]) / extent[va];
+        rec.uv_scale = 1 / sqrt(extent[ua] * extent[va]);
+        rec.mat_ptr = mat_ptr;
+        vec3 n(0, 0, 0);
+        n[a] = 1;
+        rec.normal = face % 2 ? n : -n;
     }
 
     bool bounding_box(float t0, float t1, aabb& box) const {
@@ -120,9 +247,31 @@ public:
         return true;
     }
 
+    void emitters(std::vector<emitter>& out) const {
+        if (list_ptr) {
+            list_ptr->emitters(out);
+            return;
+        }
+        vec3 extent = pmax - pmin;
+        for (int face = 0; face < 6; face++) {
+            int a = 2 - face / 2;
+            vec3 corner = pmin, edge_u(0, 0, 0), edge_v(0, 0, 0);
+            corner[a] = face % 2 ? pmax[a] : pmin[a];
+            edge_u[a == 0 ? 1 : 0] = extent[a == 0 ? 1 : 0];
+            edge_v[a == 2 ? 1 : 2] = extent[a == 2 ? 1 : 2];
+            rect_emitters(out, corner, edge_u, edge_v, mat_ptr, this);
+        }
+    }
+
+    // one slab test instead of hitting the faces twice
+    bool hit_interval(const ray& r, float t_min, float t_max, float& t_enter, float& t_exit) const {
+        return aabb(pmin, pmax).hit(r, t_min, t_max, t_enter, t_exit);
+    }
+
     vec3 pmin, pmax;
     material* mat_ptr;
-    hitable_list* list_ptr;
+    // faces as rects, only if their materials differ
+    hitable_list* list_ptr = nullptr;
 };
 
 bool is_inside_of_triangle(float tx, float ty, float x0, float y0, float x1, float y1, float x2, float y2)
@@ -149,10 +298,11 @@ bool is_inside_of_triangle(float tx, float ty, float x0, float y0, float x1, flo
     return true;
 }
 
+// Texture coordinates and normals left 0 mean the mesh has none.
 struct triangle_parameter {
     vec3 v0, v1, v2;
-    vec3 vt0, vt1, vt2;
-    vec3 vn0, vn1, vn2;
+    vec3 vt0 { 0, 0, 0 }, vt1 { 0, 0, 0 }, vt2 { 0, 0, 0 };
+    vec3 vn0 { 0, 0, 0 }, vn1 { 0, 0, 0 }, vn2 { 0, 0, 0 };
     bool has_tex_coord { false };
     bool has_normal { false };
 };
@@ -161,54 +311,69 @@ struct triangle_parameter {
 // See Fast, Minimum Storage Ray/Triangle Intersection
 class triangle : public hitable {
 public:
-    triangle(triangle_parameter param, material* mat) : p(param), mat_ptr(mat) { }
+    triangle(triangle_parameter param, material* mat) : p(param), mat_ptr(mat) {
+        // ratio of texture coordinate area to world area, for texture filtering
+        float area = cross(p.v1 - p.v0, p.v2 - p.v0).length();
+        float uv_area = cross(p.vt1 - p.vt0, p.vt2 - p.vt0).length();
+        uv_scale = area > 0 ? sqrt(uv_area / area) : 0;
+    }
 
-    bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    bool hit(const ray& r, float t_min, float t_max, hit_info& hit) const {
         const vec3 edge1 = p.v1 - p.v0;
         const vec3 edge2 = p.v2 - p.v0;
         const vec3 pvec = cross(r.direction(), edge2);
         const float det = dot(edge1, pvec);
-        float inv_det = 1.0 / det;
+        float inv_det = 1 / det;
         const float EPSILON = 1e-6;
         const vec3 tvec = r.origin() - p.v0;
         // backfacing
         if (det < EPSILON)
             return false;
 
-        rec.u = dot(tvec, pvec);
-        if (rec.u < 0.0 || rec.u > det)
+        float u = dot(tvec, pvec);
+        if (u < 0 || u > det)
             return false;
 
         vec3 qvec = cross(tvec, edge1);
 
-        rec.v = dot(r.direction(), qvec);
-        if (rec.v < 0.0 || rec.u + rec.v > det)
+        float v = dot(r.direction(), qvec);
+        if (v < 0 || u + v > det)
             return false;
 
-        // std::cerr << inv_det << std::endl;
-        rec.t = dot(edge2, qvec);
-        rec.t *= inv_det;
-        rec.u *= inv_det;
-        rec.v *= inv_det;
+        float t = dot(edge2, qvec) * inv_det;
+        if (t < t_min || t_max < t)
+            return false;
+
+        // barycentric coordinates, converted to texture coordinates in surface()
+        hit.t = t;
+        hit.u = u * inv_det;
+        hit.v = v * inv_det;
+        hit.obj = this;
+        hit.wrappers = 0;
+        return true;
+    }
+
+    void surface(const ray& r, const hit_info& hit, hit_record& rec) const {
+        const vec3 edge1 = p.v1 - p.v0;
+        const vec3 edge2 = p.v2 - p.v0;
         {
             // Check texture coordinate and set
             vec3 vt1 = p.vt1 - p.vt0;
             vec3 vt2 = p.vt2 - p.vt0;
             if (vt1.norm() < 1e-7 && vt2.norm() < 1e-7) {
                 // FIXME: probably it doesn't have texture coord.
+                rec.u = hit.u;
+                rec.v = hit.v;
             } else {
-                vec3 uv = p.vt0 + vt1 * rec.u + vt2 * rec.v;
+                vec3 uv = p.vt0 + vt1 * hit.u + vt2 * hit.v;
                 rec.u = uv.x();
                 rec.v = uv.y();
+                rec.uv_scale = uv_scale;
             }
         }
         rec.mat_ptr = mat_ptr;
         rec.p = r.point_at_parameter(rec.t);
         rec.normal = unit_vector(cross(edge1, edge2));
-        if (rec.t < t_min || t_max < rec.t)
-            return false;
-
-        return true;
     }
 
     bool bounding_box(float t0, float t1, aabb& box) const {
@@ -227,8 +392,24 @@ public:
         box = aabb(mins, maxs);
         return true;
     }
+
+    // Seen only from the front, as hit() culls back faces.
+    void emitters(std::vector<emitter>& out) const {
+        // texture coordinates of the centroid, like surface() finds them
+        float u = 1.0f / 3, v = 1.0f / 3;
+        if ((p.vt1 - p.vt0).norm() >= 1e-7 || (p.vt2 - p.vt0).norm() >= 1e-7) {
+            vec3 uv = (p.vt0 + p.vt1 + p.vt2) / 3;
+            u = uv.x();
+            v = uv.y();
+        }
+        vec3 radiance = emission(mat_ptr, u, v, (p.v0 + p.v1 + p.v2) / 3);
+        if (max_component(radiance) > 0)
+            out.push_back({ p.v0, p.v1, p.v2, radiance, false, this, this });
+    }
+
     triangle_parameter p;
     material* mat_ptr;
+    float uv_scale;
 };
 
 class xy_triangle : public hitable {
@@ -237,7 +418,7 @@ public:
         : x0(_x0), x1(_x1), x2(_x2), y0(_y0), y1(_y1), y2(_y2), z(_z), mat_ptr(mat) {
     }
 
-    bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    bool hit(const ray& r, float t_min, float t_max, hit_info& hit) const {
         float t = (z - r.origin().z()) / r.direction().z();
         if (t < t_min || t_max < t)
             return false;
@@ -246,13 +427,18 @@ public:
         if (!is_inside_of_triangle(x, y, x0, y0, x1, y1, x2, y2))
             return false;
 
-        rec.u = (x - x0) / (x1 - x0);
-        rec.v = (y - y0) / (y1 - y0);
-        rec.t = t;
+        hit.t = t;
+        hit.obj = this;
+        hit.wrappers = 0;
+        return true;
+    }
+
+    void surface(const ray& r, const hit_info& hit, hit_record& rec) const {
+        rec.p = r.point_at_parameter(rec.t);
+        rec.u = (rec.p.x() - x0) / (x1 - x0);
+        rec.v = (rec.p.y() - y0) / (y1 - y0);
         rec.mat_ptr = mat_ptr;
-        rec.p = r.point_at_parameter(t);
         rec.normal = vec3(0, 0, 1);
-        return true;
     }
 
     bool bounding_box(float t0, float t1, aabb& box) const {
@@ -276,7 +462,7 @@ public:
         : x0(_x0), x1(_x1), x2(_x2), z0(_z0), z1(_z1), z2(_z2), y(_y), mat_ptr(mat) {
     }
 
-    bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    bool hit(const ray& r, float t_min, float t_max, hit_info& hit) const {
         float t = (y - r.origin().y()) / r.direction().y();
         if (t < t_min || t_max < t)
             return false;
@@ -285,13 +471,18 @@ public:
         if (!is_inside_of_triangle(x, z, x0, z0, x1, z1, x2, z2))
             return false;
 
-        rec.u = (x - x0) / (x1 - x0);
-        rec.v = (z - z0) / (z1 - z0);
-        rec.t = t;
+        hit.t = t;
+        hit.obj = this;
+        hit.wrappers = 0;
+        return true;
+    }
+
+    void surface(const ray& r, const hit_info& hit, hit_record& rec) const {
+        rec.p = r.point_at_parameter(rec.t);
+        rec.u = (rec.p.x() - x0) / (x1 - x0);
+        rec.v = (rec.p.z() - z0) / (z1 - z0);
         rec.mat_ptr = mat_ptr;
-        rec.p = r.point_at_parameter(t);
         rec.normal = vec3(0, 1, 0);
-        return true;
     }
 
     bool bounding_box(float t0, float t1, aabb& box) const {
@@ -315,7 +506,7 @@ public:
         : y0(_y0), y1(_y1), y2(_y2), z0(_z0), z1(_z1), z2(_z2), x(_x), mat_ptr(mat) {
     }
 
-    bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    bool hit(const ray& r, float t_min, float t_max, hit_info& hit) const {
         float t = (x - r.origin().x()) / r.direction().x();
         if (t < t_min || t_max < t)
             return false;
@@ -324,13 +515,18 @@ public:
         if (!is_inside_of_triangle(y, z, y0, z0, y1, z1, y2, z2))
             return false;
 
-        rec.u = (y - y0) / (y1 - y0);
-        rec.v = (z - z0) / (z1 - z0);
-        rec.t = t;
+        hit.t = t;
+        hit.obj = this;
+        hit.wrappers = 0;
+        return true;
+    }
+
+    void surface(const ray& r, const hit_info& hit, hit_record& rec) const {
+        rec.p = r.point_at_parameter(rec.t);
+        rec.u = (rec.p.y() - y0) / (y1 - y0);
+        rec.v = (rec.p.z() - z0) / (z1 - z0);
         rec.mat_ptr = mat_ptr;
-        rec.p = r.point_at_parameter(t);
         rec.normal = vec3(1, 0, 0);
-        return true;
     }
 
     bool bounding_box(float t0, float t1, aabb& box) const {
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cstdint>
+
+// Source of the random numbers of one path. A path uses them in order, each
+// call to next() taking the next dimension, so with start() at the same
+// pixel, sample and dimension a sampler gives the same numbers again.
+//
+// While a thread has a current sampler, rand_float() draws from it: the
+// camera, the materials and the light sampling then take their numbers from
+// the path's dimensions without knowing about samplers.
+class sampler {
+public:
+    virtual ~sampler() { }
+
+    // Starts sample index of pixel (x, y) at dimension.
+    virtual void start(int x, int y, int index, int dimension = 0) = 0;
+    // Next dimension of the current sample, in [0, 1).
+    virtual float next() = 0;
+    // Dimensions used so far by the current sample.
+    virtual int dimension() const = 0;
+
+    static inline thread_local sampler* current = nullptr;
+
+protected:
+    static uint32_t hash(uint32_t x) {
+        x ^= x >> 16;
+        x *= 0x7feb352d;
+        x ^= x >> 15;
+        x *= 0x846ca68b;
+        x ^= x >> 16;
+        return x;
+    }
+
+    static float to_float(uint32_t x) {
+        // top 24 bits, so rounding never gives 1
+        return (x >> 8) * (1.0f / (1 << 24));
+    }
+};
+
+// Independent uniform numbers, hashed from the pixel, sample and dimension.
+class independent_sampler : public sampler {
+public:
+    void start(int x, int y, int index, int dimension = 0) override {
+        pixel_seed = hash(uint32_t(x) ^ hash(uint32_t(y)));
+        sample = index;
+        dim = dimension;
+    }
+    float next() override {
+        return to_float(hash(pixel_seed ^ hash(uint32_t(sample) ^ hash(uint32_t(dim++)))));
+    }
+    int dimension() const override { return dim; }
+
+private:
+    uint32_t pixel_seed = 0;
+    int sample = 0;
+    int dim = 0;
+};
+
+// Owen-scrambled Sobol points, padded in pairs of dimensions, after Burley,
+// "Practical Hash-based Owen Scrambling". Every two dimensions are the first
+// two of the Sobol sequence, a (0, 2)-sequence, so the samples of a pixel
+// are stratified in both at once at every power of two. Each pair and each
+// pixel shuffles the order of the points and scrambles them with its own
+// seed, which keeps the pairs independent of each other and the error of
+// neighbouring pixels uncorrelated.
+class sobol_sampler : public sampler {
+public:
+    // dimensions taken from the points, enough for the camera and the first
+    // bounces
+    static const int sobol_dimensions = 16;
+
+    void start(int x, int y, int index, int dimension = 0) override {
+        pixel_seed = hash(uint32_t(x) ^ hash(uint32_t(y) ^ 0x5bd1e995));
+        sample = index;
+        dim = dimension;
+        pair = -1;
+    }
+
+    float next() override {
+        // Deep into a path the points no longer stratify anything, the
+        // rest is independent and cheaper.
+        if (dim >= sobol_dimensions)
+            return to_float(hash(pixel_seed ^ hash(sample ^ hash(uint32_t(dim++)))));
+        // both dimensions of a pair come from one point
+        if (dim / 2 != pair) {
+            pair = dim / 2;
+            uint32_t seed = hash(pixel_seed ^ uint32_t(pair));
+            uint32_t i = nested_uniform_scramble(sample, seed);
+            point[0] = nested_uniform_scramble(reverse_bits(i), hash(seed + 1));
+            point[1] = nested_uniform_scramble(sobol_second(i), hash(seed + 2));
+        }
+        return to_float(point[dim++ % 2]);
+    }
+
+    int dimension() const override { return dim; }
+
+private:
+    static uint32_t reverse_bits(uint32_t x) {
+        x = (x << 16) | (x >> 16);
+        x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+        x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+        x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+        x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+        return x;
+    }
+
+    // Second dimension of the Sobol sequence, the first being reverse_bits().
+    // Its generator matrix is Pascal's triangle mod 2: bit m of the reversed
+    // result is the xor of the bits k of i with m a subset of k, summed over
+    // supersets one bit of the position at a time.
+    static uint32_t sobol_second(uint32_t i) {
+        i ^= (i >> 1) & 0x55555555;
+        i ^= (i >> 2) & 0x33333333;
+        i ^= (i >> 4) & 0x0f0f0f0f;
+        i ^= (i >> 8) & 0x00ff00ff;
+        i ^= (i >> 16) & 0x0000ffff;
+        return reverse_bits(i);
+    }
+
+    // Laine and Karras' hash, which only lets lower bits change higher ones
+    static uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+        x += seed;
+        x ^= x * 0x6c50b47c;
+        x ^= x * 0xb82f1e52;
+        x ^= x * 0xc7afe638;
+        x ^= x * 0x8d22f6e6;
+        return x;
+    }
+
+    // Owen scrambling: each bit flips depending on the bits above it
+    static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+        return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+    }
+
+    uint32_t pixel_seed = 0;
+    uint32_t sample = 0;
+    int dim = 0;
+    // pair of dimensions point holds
+    int pair = -1;
+    uint32_t point[2];
+};
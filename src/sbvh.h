@@ -0,0 +1,337 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh.h"
+#include "rect.h"
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+// Split BVH (Stich et al., Spatial Splits in Bounding Volume Hierarchies).
+// Besides partitioning primitives like bvh_node, a node may cut its space by
+// a plane and put a primitive crossing it into both children, each with the
+// box of the part on its side. This keeps long diagonal triangles from
+// bloating every node they pass through, at the cost of build time and
+// duplicated references.
+
+struct sbvh_options {
+    // number of candidate planes per axis is bins - 1
+    int bins = 16;
+    // extra references spatial splits may create, relative to the number
+    // of primitives
+    float memory_budget = 0.5;
+    // Spatial splits are tried only when the children of the best object
+    // split overlap by more than this fraction of the root area.
+    float min_overlap = 1e-5;
+};
+
+struct sbvh_reference {
+    hitable* prim;
+    // set when the primitive is a triangle, which is clipped exactly;
+    // other primitives are split by their box only
+    const triangle* tri;
+    aabb box;
+};
+
+class sbvh_builder {
+public:
+    sbvh_builder(float t0, float t1, const sbvh_options& opt)
+        : time0(t0)
+        , time1(t1)
+        , options(opt)
+    {
+    }
+
+    bvh_node* build(hitable** l, int n)
+    {
+        std::vector<sbvh_reference> refs;
+        for (int i = 0; i < n; i++) {
+            sbvh_reference ref { l[i], dynamic_cast<const triangle*>(l[i]), aabb() };
+            if (!l[i]->bounding_box(time0, time1, ref.box))
+                std::cerr << "No bounding box in sbvh_builder!" << std::endl;
+            refs.push_back(ref);
+        }
+        remaining_references = int(n * options.memory_budget);
+        root_area = area(bounds_of(refs));
+        return build_node(refs);
+    }
+
+    int duplicated_references = 0;
+
+private:
+    struct split {
+        float cost = std::numeric_limits<float>::max();
+        int axis = -1;
+        // object split: first bin of the right child, spatial split: plane
+        float position = 0;
+        aabb left_box = empty_box();
+        aabb right_box = empty_box();
+    };
+
+    static aabb empty_box()
+    {
+        float inf = std::numeric_limits<float>::max();
+        return aabb(vec3(inf, inf, inf), vec3(-inf, -inf, -inf));
+    }
+
+    static bool is_empty(const aabb& b)
+    {
+        return b.min().x() > b.max().x() || b.min().y() > b.max().y() || b.min().z() > b.max().z();
+    }
+
+    static float area(const aabb& b)
+    {
+        return is_empty(b) ? 0 : b.area();
+    }
+
+    static aabb intersection(const aabb& a, const aabb& b)
+    {
+        vec3 small(ffmax(a.min().x(), b.min().x()),
+            ffmax(a.min().y(), b.min().y()),
+            ffmax(a.min().z(), b.min().z()));
+        vec3 big(ffmin(a.max().x(), b.max().x()),
+            ffmin(a.max().y(), b.max().y()),
+            ffmin(a.max().z(), b.max().z()));
+        return aabb(small, big);
+    }
+
+    static aabb bounds_of(const std::vector<sbvh_reference>& refs)
+    {
+        aabb b = empty_box();
+        for (const auto& ref : refs)
+            b = surrounding_box(b, ref.box);
+        return b;
+    }
+
+    // Box of the part of ref between lo and hi on axis.
+    static aabb clip(const sbvh_reference& ref, int axis, float lo, float hi)
+    {
+        if (!ref.tri) {
+            aabb slab = ref.box;
+            slab._min[axis] = ffmax(slab._min[axis], lo);
+            slab._max[axis] = ffmin(slab._max[axis], hi);
+            return slab;
+        }
+        // Sutherland-Hodgman against both planes of the slab. Each plane
+        // adds at most one vertex.
+        vec3 poly[5] = { ref.tri->p.v0, ref.tri->p.v1, ref.tri->p.v2 };
+        int count = 3;
+        for (int side = 0; side < 2 && count > 0; side++) {
+            float plane = side == 0 ? lo : hi;
+            float sign = side == 0 ? 1 : -1;
+            vec3 out[5];
+            int out_count = 0;
+            for (int i = 0; i < count; i++) {
+                const vec3& a = poly[i];
+                const vec3& b = poly[(i + 1) % count];
+                float da = sign * (a[axis] - plane);
+                float db = sign * (b[axis] - plane);
+                if (da >= 0)
+                    out[out_count++] = a;
+                if ((da < 0 && db > 0) || (da > 0 && db < 0))
+                    out[out_count++] = a + (da / (da - db)) * (b - a);
+            }
+            std::copy(out, out + out_count, poly);
+            count = out_count;
+        }
+        aabb b = empty_box();
+        for (int i = 0; i < count; i++) {
+            const vec3& p = poly[i];
+            // same padding as triangle::bounding_box, boxes must have volume
+            b = surrounding_box(b, aabb(p - vec3(0.0001, 0.0001, 0.0001), p + vec3(0.0001, 0.0001, 0.0001)));
+        }
+        return intersection(b, ref.box);
+    }
+
+    split find_object_split(const std::vector<sbvh_reference>& refs) const
+    {
+        const int bins = options.bins;
+        aabb centroids = empty_box();
+        for (const auto& ref : refs) {
+            vec3 c = 0.5f * (ref.box.min() + ref.box.max());
+            centroids = surrounding_box(centroids, aabb(c, c));
+        }
+        split best;
+        for (int axis = 0; axis < 3; axis++) {
+            float lo = centroids.min()[axis];
+            float extent = centroids.max()[axis] - lo;
+            if (extent <= 0)
+                continue;
+            std::vector<int> counts(bins, 0);
+            std::vector<aabb> boxes(bins, empty_box());
+            for (const auto& ref : refs) {
+                float c = 0.5f * (ref.box.min()[axis] + ref.box.max()[axis]);
+                int b = std::min(bins - 1, int(bins * (c - lo) / extent));
+                counts[b]++;
+                boxes[b] = surrounding_box(boxes[b], ref.box);
+            }
+            evaluate_planes(counts, counts, boxes, axis, 0, 1, best);
+        }
+        return best;
+    }
+
+    split find_spatial_split(const std::vector<sbvh_reference>& refs, const aabb& bounds) const
+    {
+        const int bins = options.bins;
+        split best;
+        for (int axis = 0; axis < 3; axis++) {
+            float lo = bounds.min()[axis];
+            float extent = bounds.max()[axis] - lo;
+            if (extent <= 0)
+                continue;
+            float width = extent / bins;
+            std::vector<int> entries(bins, 0), exits(bins, 0);
+            std::vector<aabb> boxes(bins, empty_box());
+            for (const auto& ref : refs) {
+                int first = std::clamp(int((ref.box.min()[axis] - lo) / width), 0, bins - 1);
+                int last = std::clamp(int((ref.box.max()[axis] - lo) / width), first, bins - 1);
+                for (int b = first; b <= last; b++) {
+                    float bin_lo = lo + b * width;
+                    float bin_hi = b == bins - 1 ? bounds.max()[axis] : bin_lo + width;
+                    boxes[b] = surrounding_box(boxes[b], clip(ref, axis, bin_lo, bin_hi));
+                }
+                entries[first]++;
+                exits[last]++;
+            }
+            evaluate_planes(entries, exits, boxes, axis, lo, width, best);
+        }
+        return best;
+    }
+
+    // Sweeps the planes between bins. A reference counts on the left of a
+    // plane if it enters a bin before it, and on the right if it leaves a
+    // bin after it. The plane before bin i is stored as offset + i * scale.
+    static void evaluate_planes(const std::vector<int>& entries, const std::vector<int>& exits,
+        const std::vector<aabb>& boxes, int axis, float offset, float scale, split& best)
+    {
+        const int bins = boxes.size();
+        std::vector<aabb> right_boxes(bins, empty_box());
+        std::vector<int> right_counts(bins, 0);
+        aabb acc = empty_box();
+        int count = 0;
+        for (int i = bins - 1; i > 0; i--) {
+            acc = surrounding_box(acc, boxes[i]);
+            count += exits[i];
+            right_boxes[i] = acc;
+            right_counts[i] = count;
+        }
+        acc = empty_box();
+        count = 0;
+        for (int i = 1; i < bins; i++) {
+            acc = surrounding_box(acc, boxes[i - 1]);
+            count += entries[i - 1];
+            if (count == 0 || right_counts[i] == 0)
+                continue;
+            float cost = area(acc) * count + area(right_boxes[i]) * right_counts[i];
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.position = offset + i * scale;
+                best.left_box = acc;
+                best.right_box = right_boxes[i];
+            }
+        }
+    }
+
+    bool perform_object_split(const std::vector<sbvh_reference>& refs, const split& s,
+        std::vector<sbvh_reference>& left, std::vector<sbvh_reference>& right) const
+    {
+        if (s.axis < 0)
+            return false;
+        const int bins = options.bins;
+        float lo = std::numeric_limits<float>::max();
+        float hi = std::numeric_limits<float>::lowest();
+        for (const auto& ref : refs) {
+            float c = 0.5f * (ref.box.min()[s.axis] + ref.box.max()[s.axis]);
+            lo = std::min(lo, c);
+            hi = std::max(hi, c);
+        }
+        for (const auto& ref : refs) {
+            float c = 0.5f * (ref.box.min()[s.axis] + ref.box.max()[s.axis]);
+            int b = std::min(bins - 1, int(bins * (c - lo) / (hi - lo)));
+            (b < s.position ? left : right).push_back(ref);
+        }
+        return !left.empty() && !right.empty();
+    }
+
+    bool perform_spatial_split(const std::vector<sbvh_reference>& refs, const split& s,
+        std::vector<sbvh_reference>& left, std::vector<sbvh_reference>& right)
+    {
+        const float inf = std::numeric_limits<float>::max();
+        int duplicated = 0;
+        for (const auto& ref : refs) {
+            if (ref.box.max()[s.axis] <= s.position) {
+                left.push_back(ref);
+            } else if (ref.box.min()[s.axis] >= s.position) {
+                right.push_back(ref);
+            } else {
+                sbvh_reference l = ref, r = ref;
+                l.box = clip(ref, s.axis, -inf, s.position);
+                r.box = clip(ref, s.axis, s.position, inf);
+                if (!is_empty(l.box))
+                    left.push_back(l);
+                if (!is_empty(r.box))
+                    right.push_back(r);
+                if (!is_empty(l.box) && !is_empty(r.box))
+                    duplicated++;
+            }
+        }
+        if (duplicated > remaining_references || left.empty() || right.empty()
+            || (left.size() == refs.size() && right.size() == refs.size())) {
+            left.clear();
+            right.clear();
+            return false;
+        }
+        remaining_references -= duplicated;
+        duplicated_references += duplicated;
+        return true;
+    }
+
+    bvh_node* build_node(std::vector<sbvh_reference>& refs)
+    {
+        bvh_node* node = new bvh_node();
+        node->box = bounds_of(refs);
+        if (refs.size() <= 2) {
+            node->left = refs.front().prim;
+            node->right = refs.back().prim;
+            node->leaf = true;
+            node->mark_nested();
+            return node;
+        }
+
+        std::vector<sbvh_reference> left, right;
+        split object = find_object_split(refs);
+        split spatial;
+        if (remaining_references > 0
+            && area(intersection(object.left_box, object.right_box)) > options.min_overlap * root_area)
+            spatial = find_spatial_split(refs, node->box);
+
+        bool done = spatial.cost < object.cost && perform_spatial_split(refs, spatial, left, right);
+        if (!done)
+            done = perform_object_split(refs, object, left, right);
+        if (!done) {
+            // All centroids coincide. Split in the middle of the list.
+            left.assign(refs.begin(), refs.begin() + refs.size() / 2);
+            right.assign(refs.begin() + refs.size() / 2, refs.end());
+        }
+        // release before going deeper, the children hold copies
+        std::vector<sbvh_reference>().swap(refs);
+
+        node->left = build_node(left);
+        node->right = build_node(right);
+        node->leaf = false;
+        return node;
+    }
+
+    float time0, time1;
+    sbvh_options options;
+    int remaining_references = 0;
+    float root_area = 0;
+};
+
+bvh_node* build_sbvh(hitable** l, int n, float t0, float t1, const sbvh_options& opt = sbvh_options())
+{
+    sbvh_builder builder(t0, t1, opt);
+    return builder.build(l, n);
+}
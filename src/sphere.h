@@ -6,18 +6,21 @@ class sphere : public hitable {
 public:
     sphere() {}
     sphere(vec3 cen, float r, material* mat) : center(cen), radius(r), mat_ptr(mat) {}
-    bool hit(const ray& r, float tmin, float tmax, hit_record& rec) const override;
+    bool hit(const ray& r, float tmin, float tmax, hit_info& hit) const override;
     bool bounding_box(float t0, float t1, aabb& box) const override;
+    void surface(const ray& r, const hit_info& hit, hit_record& rec) const override;
+    bool point_at_uv(float u, float v, vec3& p) const override;
+    bool hit_interval(const ray& r, float t_min, float t_max, float& t_enter, float& t_exit) const override;
     vec3 center;
     float radius;
     material* mat_ptr;
 };
 
-bool sphere::hit(const ray& r, float tmin, float tmax, hit_record& rec) const
+bool sphere::hit(const ray& r, float tmin, float tmax, hit_info& hit) const
 {
     vec3 oc = r.origin() - center;
     float a = dot(r.direction(), r.direction());
-    float b = 2.0 * dot(oc, r.direction());
+    float b = 2 * dot(oc, r.direction());
     float c = dot(oc, oc) - radius * radius;
     float discriminant = b*b - 4*a*c;
 
@@ -26,24 +29,56 @@ bool sphere::hit(const ray& r, float tmin, float tmax, hit_record& rec) const
         float t2 = (-b + sqrt(discriminant)) / (2*a);
 
         if (tmin < t1 && t1 < tmax) {
-            rec.t = t1;
-            rec.p = r.point_at_parameter(t1);
-            rec.normal = (rec.p - center) / radius;
-            rec.mat_ptr = mat_ptr;
-            get_sphere_uv((rec.p - center) / radius, rec.u, rec.v);
+            hit.t = t1;
+            hit.obj = this;
+            hit.wrappers = 0;
             return true;
         } else if(tmin < t2 && t2 < tmax) {
-            rec.t = t2;
-            rec.p = r.point_at_parameter(t2);
-            rec.normal = (rec.p - center) / radius;
-            rec.mat_ptr = mat_ptr;
-            get_sphere_uv((rec.p - center) / radius, rec.u, rec.v);
+            hit.t = t2;
+            hit.obj = this;
+            hit.wrappers = 0;
             return true;
         }
     }
     return false;
 }
 
+// Both roots of the quadratic in hit(), clipped.
+bool sphere::hit_interval(const ray& r, float t_min, float t_max, float& t_enter, float& t_exit) const
+{
+    vec3 oc = r.origin() - center;
+    float a = dot(r.direction(), r.direction());
+    float b = 2 * dot(oc, r.direction());
+    float c = dot(oc, oc) - radius * radius;
+    float discriminant = b*b - 4*a*c;
+    if (discriminant <= 0)
+        return false;
+    float t1 = (-b - sqrt(discriminant)) / (2*a);
+    float t2 = (-b + sqrt(discriminant)) / (2*a);
+    t_enter = std::max(t1, t_min);
+    t_exit = std::min(t2, t_max);
+    return t_enter < t_exit;
+}
+
+void sphere::surface(const ray& r, const hit_info& hit, hit_record& rec) const
+{
+    rec.p = r.point_at_parameter(rec.t);
+    rec.normal = (rec.p - center) / radius;
+    rec.mat_ptr = mat_ptr;
+    get_sphere_uv(rec.normal, rec.u, rec.v);
+    // u wraps around 2 pi r and v spans pi r
+    rec.uv_scale = 1 / (float(M_SQRT2 * M_PI) * radius);
+}
+
+// inverse of get_sphere_uv
+bool sphere::point_at_uv(float u, float v, vec3& p) const
+{
+    float phi = (1 - u) * float(2 * M_PI) - float(M_PI);
+    float theta = v * float(M_PI) - float(M_PI / 2);
+    p = center + radius * vec3(cos(theta) * cos(phi), sin(theta), cos(theta) * sin(phi));
+    return true;
+}
+
 bool sphere::bounding_box(float t0, float t1, aabb& box) const
 {
     box = aabb(center - vec3(radius, radius, radius),
@@ -1,13 +1,21 @@
 #pragma once
 
+#include "grid.h"
+#include "image.h"
 #include "vec3.h"
 
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 class texture {
 public:
     virtual vec3 value(float u, float v, const vec3& p) const = 0;
+    // Value averaged over footprint (in texture coordinates) around u, v.
+    // Textures which do not filter return the point value.
+    virtual vec3 filtered_value(float u, float v, const vec3& p, float footprint) const {
+        return value(u, v, p);
+    }
 };
 
 class constant_texture : public texture
@@ -33,6 +41,14 @@ public:
             return even->value(u, v, p);
     }
 
+    vec3 filtered_value(float u, float v, const vec3& p, float footprint) const override {
+        float sines = sin(10 * p.x()) * sin(10 * p.y()) * sin(10 * p.z());
+        if (sines < 0)
+            return odd->filtered_value(u, v, p, footprint);
+        else
+            return even->filtered_value(u, v, p, footprint);
+    }
+
     texture* odd;
     texture* even;
 };
@@ -71,13 +87,101 @@ public:
 
         return trilinear_interp(c, u, v, w);
     }
+    // Four noise values at once, out[l] = noise(vec3(x[l], y[l], z[l])). The
+    // lanes share the floor, fade and interpolation arithmetic; only the
+    // table lookups stay scalar.
+    void noise4(const float x[4], const float y[4], const float z[4], float out[4]) const {
+#ifdef __SSE2__
+        const __m128 one = _mm_set1_ps(1.0f);
+        __m128 p[3] = { _mm_loadu_ps(x), _mm_loadu_ps(y), _mm_loadu_ps(z) };
+        __m128 f[3], fade[3];
+        alignas(16) int cell[3][4];
+        for (int a = 0; a < 3; a++) {
+            // floor: truncate, then step down where that rounded up
+            __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(p[a]));
+            t = _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, p[a]), one));
+            _mm_store_si128((__m128i*)cell[a], _mm_cvttps_epi32(t));
+            f[a] = _mm_sub_ps(p[a], t);
+            // f * f * (3 - 2 * f)
+            fade[a] = _mm_mul_ps(_mm_mul_ps(f[a], f[a]), _mm_sub_ps(_mm_set1_ps(3.0f), _mm_add_ps(f[a], f[a])));
+        }
+
+        // permutations of both cell planes on each axis, per lane
+        int hash[3][2][4];
+        for (int l = 0; l < 4; l++) {
+            for (int d = 0; d < 2; d++) {
+                hash[0][d][l] = perm_x[(cell[0][l] + d) & 255];
+                hash[1][d][l] = perm_y[(cell[1][l] + d) & 255];
+                hash[2][d][l] = perm_z[(cell[2][l] + d) & 255];
+            }
+        }
+
+        // corner gradient dotted with the offset from that corner
+        __m128 d[2][2][2];
+        for (int di = 0; di < 2; di++) {
+            for (int dj = 0; dj < 2; dj++) {
+                for (int dk = 0; dk < 2; dk++) {
+                    alignas(16) float g[3][4];
+                    for (int l = 0; l < 4; l++) {
+                        const vec3& r = ranvec[hash[0][di][l] ^ hash[1][dj][l] ^ hash[2][dk][l]];
+                        g[0][l] = r.x();
+                        g[1][l] = r.y();
+                        g[2][l] = r.z();
+                    }
+                    __m128 ox = _mm_sub_ps(f[0], _mm_set1_ps(di));
+                    __m128 oy = _mm_sub_ps(f[1], _mm_set1_ps(dj));
+                    __m128 oz = _mm_sub_ps(f[2], _mm_set1_ps(dk));
+                    d[di][dj][dk] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_load_ps(g[0]), ox),
+                                                          _mm_mul_ps(_mm_load_ps(g[1]), oy)),
+                                               _mm_mul_ps(_mm_load_ps(g[2]), oz));
+                }
+            }
+        }
+
+        // trilinear blend by the fade weights, z then y then x
+        auto lerp = [](__m128 a, __m128 b, __m128 t) { return _mm_add_ps(a, _mm_mul_ps(t, _mm_sub_ps(b, a))); };
+        __m128 c00 = lerp(d[0][0][0], d[0][0][1], fade[2]);
+        __m128 c01 = lerp(d[0][1][0], d[0][1][1], fade[2]);
+        __m128 c10 = lerp(d[1][0][0], d[1][0][1], fade[2]);
+        __m128 c11 = lerp(d[1][1][0], d[1][1][1], fade[2]);
+        __m128 c0 = lerp(c00, c01, fade[1]);
+        __m128 c1 = lerp(c10, c11, fade[1]);
+        _mm_storeu_ps(out, lerp(c0, c1, fade[0]));
+#else
+        for (int l = 0; l < 4; l++)
+            out[l] = noise(vec3(x[l], y[l], z[l]));
+#endif
+    }
+
+    // Sum of depth octaves, four octaves per noise4 call.
     float turb(const vec3& p, int depth=7) const {
+        float accum = 0;
+        float frequency = 1;
+        for (int first = 0; first < depth; first += 4) {
+            float x[4], y[4], z[4], weight[4], n[4];
+            for (int l = 0; l < 4; l++) {
+                bool used = first + l < depth;
+                x[l] = frequency * p.x();
+                y[l] = frequency * p.y();
+                z[l] = frequency * p.z();
+                weight[l] = used ? 1 / frequency : 0;
+                frequency *= 2;
+            }
+            noise4(x, y, z, n);
+            for (int l = 0; l < 4; l++)
+                accum += weight[l] * n[l];
+        }
+        return fabs(accum);
+    }
+
+    // One octave at a time through noise(), kept as the reference for turb.
+    float turb_scalar(const vec3& p, int depth=7) const {
         float accum = 0;
         vec3 temp_p = p;
-        float weight = 1.0;
+        float weight = 1;
         for (int i = 0; i < depth; i++) {
             accum += weight * noise(temp_p);
-            weight *= 0.5;
+            weight *= 0.5f;
             temp_p *= 2;
         }
         return fabs(accum);
@@ -126,31 +230,52 @@ public:
     vec3 value(float u, float v, const vec3& p) const override {
         // return vec3(1, 1, 1) * noise.turb(scale*p);
         // return vec3(1, 1, 1) * noise.noise(scale*p);
-        return vec3(1, 1, 1) * 0.5 * (1 + sin(scale*p.z() + 10 * noise.turb(p)));
+        return vec3(1, 1, 1) * 0.5f * (1 + sin(scale*p.z() + 10 * turb(p)));
+    }
+
+    float turb(const vec3& p) const {
+        float t;
+        if (baked && baked->lookup(p, t))
+            return t;
+        return noise.turb(p);
     }
+
     perlin noise;
     float scale;
+    // turbulence sampled by bake_turbulence(), nullptr if not baked
+    grid3<float>* baked = nullptr;
+};
+
+// Texture baked on a grid over space by bake_texture(). Points outside the
+// grid fall back to the source texture.
+class grid_texture : public texture {
+public:
+    grid_texture(grid3<vec3>* g, texture* s) : grid(g), source(s) { }
+    vec3 value(float u, float v, const vec3& p) const override {
+        vec3 c;
+        if (grid->lookup(p, c))
+            return c;
+        return source->value(u, v, p);
+    }
+    grid3<vec3>* grid;
+    texture* source;
 };
 
 class image_texture : public texture {
 public:
-    image_texture(unsigned char* pixels, int w, int h) : data(pixels), nx(w), ny(h) { }
+    // pixels are RGB8
+    image_texture(unsigned char* pixels, int w, int h) {
+        std::vector<unsigned char> rgba(4 * w * h, 255);
+        for (int i = 0; i < w * h; i++)
+            std::copy(pixels + 3 * i, pixels + 3 * i + 3, &rgba[4 * i]);
+        img = image::from_rgba(rgba.data(), w, h);
+    }
+    image_texture(std::shared_ptr<const mipmapped_image> i) : img(i) { }
     vec3 value(float u, float v, const vec3& p) const override {
-        int i = u * nx;
-        int j = (1 - v) * ny - 0.001;
-        if (i < 0)
-            i = 0;
-        if (i > nx - 1)
-            i = nx - 1;
-        if (j < 0)
-            j = 0;
-        if (j > ny - 1)
-            j = ny - 1;
-        float r = int(data[3 * i + 3 * nx * j + 0]) / 255.0;
-        float g = int(data[3 * i + 3 * nx * j + 1]) / 255.0;
-        float b = int(data[3 * i + 3 * nx * j + 2]) / 255.0;
-        return vec3(r, g, b);
+        return img->sample(u, v, 0);
+    }
+    vec3 filtered_value(float u, float v, const vec3& p, float footprint) const override {
+        return img->sample(u, v, footprint);
     }
-    unsigned char* data;
-    int nx, ny;
+    std::shared_ptr<const mipmapped_image> img;
 };
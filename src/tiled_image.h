@@ -0,0 +1,366 @@
+#pragma once
+
+#include "image.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Textures too large to keep decoded are converted once to a tiled file
+// holding every mip level cut into square tiles. A tiled_image reads only
+// its header up front; tiles are read on first access into texture_cache,
+// a fixed-size cache shared by all textures and render threads.
+//
+// File layout, all integers int32 in host byte order:
+//   "RTTX" version width height levels tile_size
+//   tiles of level 0 row by row, then of level 1, ...
+// Each tile is tile_size x tile_size RGBA8 texels laid out like the tiles of
+// mip_level, in 4x4 blocks in Morton order; tiles on the right and bottom
+// edges repeat the last column and row.
+
+class tiled_image;
+
+class texture_cache {
+public:
+    static constexpr int tile_size = 32;
+    static constexpr int tile_texels = tile_size * tile_size;
+    static constexpr int tile_bytes = 4 * tile_texels;
+    static_assert(tile_size == mip_level::tile_size, "tiles are laid out by mip_level::offset_in_tile");
+
+    // Takes effect only when called before the first get().
+    static void set_budget(size_t bytes) { budget() = bytes; }
+
+    // Never destroyed, images held by statics release their tiles on exit.
+    static texture_cache& get() {
+        static texture_cache* cache = new texture_cache(budget());
+        return *cache;
+    }
+
+    // Texel at offset (in texels) inside tile of img, reading the tile from
+    // disk if it is not resident.
+    vec3 texel(const tiled_image& img, int tile, int offset);
+
+    // Drops every tile of img. Called when img is destroyed.
+    void release(const tiled_image& img);
+
+    int64_t lookups() const {
+        int64_t n = 0;
+        for (const auto& c : lookup_counts)
+            n += c.value.load(std::memory_order_relaxed);
+        return n;
+    }
+    int64_t misses() const { return miss_count.load(); }
+    int64_t bytes_loaded() const { return loaded_bytes.load(); }
+    size_t capacity_bytes() const { return size_t(slots_count) * tile_bytes; }
+    float hit_rate() const {
+        int64_t n = lookups();
+        return n ? 1 - float(misses()) / n : 1;
+    }
+
+private:
+    // Resident tiles are read without locking. A slot's version is odd while
+    // the faulting thread rewrites it, so a reader that sees the version
+    // change knows its texel may be torn and falls back to fault().
+    struct slot {
+        std::atomic<uint32_t> version { 0 };
+        std::atomic<uint64_t> key { empty_key };
+        // set on every hit, cleared by the clock hand
+        std::atomic<bool> referenced { false };
+        // only touched under mutex
+        const tiled_image* owner = nullptr;
+        int tile = -1;
+        // claimed by a thread reading its tile outside the lock
+        bool loading = false;
+    };
+
+    // Lookups are counted per thread stripe, a single shared counter would
+    // be contended more than the tiles themselves.
+    struct alignas(64) counter {
+        std::atomic<int64_t> value { 0 };
+    };
+    static constexpr int counter_stripes = 64;
+    static constexpr uint64_t empty_key = ~uint64_t(0);
+    // resident value of a tile some thread is reading from disk
+    static constexpr int loading_tile = -2;
+
+    static size_t& budget() {
+        static size_t bytes = size_t(256) << 20;
+        return bytes;
+    }
+
+    static int stripe() {
+        static std::atomic<int> next { 0 };
+        thread_local int s = next++ % counter_stripes;
+        return s;
+    }
+
+    static vec3 decode(uint32_t t) {
+        unsigned char c[4];
+        std::memcpy(c, &t, 4);
+        return vec3(c[0] / 255.0f, c[1] / 255.0f, c[2] / 255.0f);
+    }
+
+    explicit texture_cache(size_t bytes)
+        : slots_count(std::max<size_t>(1, bytes / tile_bytes))
+        , slots(new slot[slots_count])
+        , texels(new std::atomic<uint32_t>[size_t(slots_count) * tile_texels])
+    {
+    }
+
+    vec3 fault(const tiled_image& img, int tile, int offset);
+    int evict();
+
+    int slots_count;
+    std::unique_ptr<slot[]> slots;
+    std::unique_ptr<std::atomic<uint32_t>[]> texels;
+    counter lookup_counts[counter_stripes];
+    std::atomic<int64_t> miss_count { 0 };
+    std::atomic<int64_t> loaded_bytes { 0 };
+    std::mutex mutex;
+    // signalled whenever a tile finishes loading
+    std::condition_variable loaded;
+    int hand = 0;
+};
+
+class tiled_image : public mipmapped_image {
+public:
+    // of the file layout; files of other versions are converted again
+    static constexpr int32_t file_version = 2;
+
+    // Returns nullptr if path is not a readable tiled file.
+    static std::shared_ptr<tiled_image> open(const std::string& path) {
+        FILE* fp = fopen(path.c_str(), "rb");
+        if (!fp)
+            return nullptr;
+        char magic[4];
+        int32_t header[5];
+        bool ok = fread(magic, 1, 4, fp) == 4 && std::memcmp(magic, "RTTX", 4) == 0
+            && fread(header, sizeof(int32_t), 5, fp) == 5;
+        if (!ok || header[0] != file_version || header[4] != texture_cache::tile_size || header[3] <= 0) {
+            fclose(fp);
+            return nullptr;
+        }
+
+        auto img = std::shared_ptr<tiled_image>(new tiled_image());
+        img->path = path;
+        img->file = fp;
+        img->id = next_id()++;
+        int w = header[1], h = header[2];
+        for (int l = 0; l < header[3]; l++) {
+            level_info info { w, h, tiles_along(w), img->tiles_count };
+            img->levels.push_back(info);
+            img->tiles_count += info.tiles_x * tiles_along(h);
+            w = std::max(1, w / 2);
+            h = std::max(1, h / 2);
+        }
+        img->resident.reset(new std::atomic<int>[img->tiles_count]);
+        for (int i = 0; i < img->tiles_count; i++)
+            img->resident[i] = -1;
+        return img;
+    }
+
+    ~tiled_image() {
+        texture_cache::get().release(*this);
+        if (file)
+            fclose(file);
+    }
+
+    int levels_count() const override { return levels.size(); }
+    int level_width(int level) const override { return levels[level].width; }
+    int level_height(int level) const override { return levels[level].height; }
+
+    vec3 texel(int level, int x, int y) const override {
+        const int size = texture_cache::tile_size;
+        const level_info& l = levels[level];
+        int tile = l.first_tile + (y / size) * l.tiles_x + x / size;
+        return texture_cache::get().texel(*this, tile, mip_level::offset_in_tile(x % size, y % size));
+    }
+
+    // Reads one tile into dst, which holds tile_bytes.
+    bool load_tile(int tile, unsigned char* dst) const {
+        long offset = header_bytes + long(tile) * texture_cache::tile_bytes;
+        std::lock_guard<std::mutex> lock(file_mutex);
+        return fseek(file, offset, SEEK_SET) == 0
+            && fread(dst, 1, texture_cache::tile_bytes, file) == size_t(texture_cache::tile_bytes);
+    }
+
+    // Writes img in the tiled format.
+    static bool write(const std::string& path, const image& img) {
+        FILE* fp = fopen(path.c_str(), "wb");
+        if (!fp)
+            return false;
+        int32_t header[5] = { file_version, img.width(), img.height(), img.levels_count(), texture_cache::tile_size };
+        bool ok = fwrite("RTTX", 1, 4, fp) == 4 && fwrite(header, sizeof(int32_t), 5, fp) == 5;
+        const int size = texture_cache::tile_size;
+        std::vector<unsigned char> tile(texture_cache::tile_bytes);
+        for (const mip_level& l : img.levels) {
+            for (int ty = 0; ty < tiles_along(l.height); ty++) {
+                for (int tx = 0; tx < tiles_along(l.width); tx++) {
+                    for (int y = 0; y < size; y++) {
+                        for (int x = 0; x < size; x++) {
+                            int sx = std::min(tx * size + x, l.width - 1);
+                            int sy = std::min(ty * size + y, l.height - 1);
+                            std::memcpy(&tile[4 * mip_level::offset_in_tile(x, y)], l.rgba(sx, sy), 4);
+                        }
+                    }
+                    ok = ok && fwrite(tile.data(), 1, tile.size(), fp) == tile.size();
+                }
+            }
+        }
+        return fclose(fp) == 0 && ok;
+    }
+
+    std::string path;
+    // distinguishes tiles of different images in the cache
+    uint32_t id = 0;
+    int tiles_count = 0;
+    // cache slot of each tile, -1 when not resident and -2 while being
+    // loaded. Written by the cache under its lock.
+    std::unique_ptr<std::atomic<int>[]> resident;
+
+private:
+    struct level_info {
+        int width, height;
+        int tiles_x;
+        int first_tile;
+    };
+
+    static constexpr long header_bytes = 4 + 5 * sizeof(int32_t);
+
+    static int tiles_along(int n) {
+        return (n + texture_cache::tile_size - 1) / texture_cache::tile_size;
+    }
+
+    static std::atomic<uint32_t>& next_id() {
+        static std::atomic<uint32_t> id { 0 };
+        return id;
+    }
+
+    tiled_image() { }
+
+    std::vector<level_info> levels;
+    // kept open for the image's lifetime, seeks and reads are serialized
+    FILE* file = nullptr;
+    mutable std::mutex file_mutex;
+};
+
+inline vec3 texture_cache::texel(const tiled_image& img, int tile, int offset)
+{
+    lookup_counts[stripe()].value.fetch_add(1, std::memory_order_relaxed);
+    int s = img.resident[tile].load(std::memory_order_acquire);
+    if (s >= 0) {
+        slot& sl = slots[s];
+        uint32_t version = sl.version.load(std::memory_order_acquire);
+        uint64_t key = sl.key.load(std::memory_order_relaxed);
+        uint32_t t = texels[size_t(s) * tile_texels + offset].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (version % 2 == 0 && key == (uint64_t(img.id) << 32 | uint32_t(tile))
+            && sl.version.load(std::memory_order_relaxed) == version) {
+            if (!sl.referenced.load(std::memory_order_relaxed))
+                sl.referenced.store(true, std::memory_order_relaxed);
+            return decode(t);
+        }
+    }
+    return fault(img, tile, offset);
+}
+
+// Clock approximation of LRU: skip and clear recently referenced slots.
+// Slots being loaded are skipped too, -1 if that is all of them.
+inline int texture_cache::evict()
+{
+    for (int n = 0; n < 2 * slots_count; n++) {
+        int s = hand;
+        hand = (hand + 1) % slots_count;
+        if (!slots[s].loading && !slots[s].referenced.exchange(false, std::memory_order_relaxed))
+            return s;
+    }
+    return -1;
+}
+
+// The slot is claimed under the lock, the tile read without it so other
+// threads keep faulting and evicting meanwhile, and published under it.
+inline vec3 texture_cache::fault(const tiled_image& img, int tile, int offset)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        int s = img.resident[tile].load(std::memory_order_relaxed);
+        // Another thread may have loaded the tile since our lookup, or be
+        // loading it.
+        if (s >= 0)
+            return decode(texels[size_t(s) * tile_texels + offset].load(std::memory_order_relaxed));
+        if (s == loading_tile) {
+            loaded.wait(lock);
+            continue;
+        }
+        s = evict();
+        if (s < 0) {
+            loaded.wait(lock);
+            continue;
+        }
+        miss_count++;
+        slot& sl = slots[s];
+        if (sl.owner)
+            sl.owner->resident[sl.tile].store(-1, std::memory_order_relaxed);
+
+        uint32_t version = sl.version.load(std::memory_order_relaxed);
+        sl.version.store(version + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        sl.key.store(uint64_t(img.id) << 32 | uint32_t(tile), std::memory_order_relaxed);
+        sl.owner = &img;
+        sl.tile = tile;
+        sl.loading = true;
+        img.resident[tile].store(loading_tile, std::memory_order_relaxed);
+        lock.unlock();
+
+        std::vector<unsigned char> data(tile_bytes);
+        if (img.load_tile(tile, data.data())) {
+            loaded_bytes += tile_bytes;
+        } else {
+            std::cerr << "Failed to read tile " << tile << " of " << img.path << std::endl;
+            std::fill(data.begin(), data.end(), 0);
+        }
+        for (int i = 0; i < tile_texels; i++) {
+            uint32_t t;
+            std::memcpy(&t, &data[4 * i], 4);
+            texels[size_t(s) * tile_texels + i].store(t, std::memory_order_relaxed);
+        }
+
+        lock.lock();
+        sl.version.store(version + 2, std::memory_order_release);
+        sl.referenced.store(true, std::memory_order_relaxed);
+        sl.loading = false;
+        img.resident[tile].store(s, std::memory_order_release);
+        loaded.notify_all();
+        return decode(texels[size_t(s) * tile_texels + offset].load(std::memory_order_relaxed));
+    }
+}
+
+// A thread still reading a tile of img would write img.resident and the
+// slot's version after they are cleared, so its loads are waited for.
+inline void texture_cache::release(const tiled_image& img)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    loaded.wait(lock, [&] {
+        for (int s = 0; s < slots_count; s++) {
+            if (slots[s].owner == &img && slots[s].loading)
+                return false;
+        }
+        return true;
+    });
+    for (int s = 0; s < slots_count; s++) {
+        slot& sl = slots[s];
+        if (sl.owner != &img)
+            continue;
+        sl.version.fetch_add(2, std::memory_order_release);
+        sl.key.store(empty_key, std::memory_order_relaxed);
+        sl.owner = nullptr;
+        sl.tile = -1;
+    }
+}
@@ -1,26 +1,28 @@
 #pragma once
 
 #include <cmath>
-#include <cassert>
 #include <iostream>
 
-class vec3 {
+#ifdef __SSE__
+#include <xmmintrin.h>
+#define VEC3_SSE 1
+#endif
+
+// Three floats padded to 16 bytes, so that a vec3 is one aligned SSE
+// register. The fourth lane is set to 0 by the constructors taking values,
+// but arithmetic may leave anything there (0 / 0 after a division), so
+// horizontal operations only ever read the first three lanes. Copying is
+// trivial, and default construction leaves the floats uninitialized like
+// those of a float; vec3() and vec3 {} are still 0.
+class alignas(16) vec3 {
 public:
-    vec3() {
-        e[0] = 0;
-        e[1] = 0;
-        e[2] = 0;
-    }
-    vec3(float e0, float e1, float e2) {
-        e[0] = e0;
-        e[1] = e1;
-        e[2] = e2;
-    }
-    vec3(const vec3& v) {
-        e[0] = v.e[0];
-        e[1] = v.e[1];
-        e[2] = v.e[2];
-    }
+    vec3() = default;
+    vec3(float e0, float e1, float e2) : e { e0, e1, e2, 0 } { }
+#ifdef VEC3_SSE
+    explicit vec3(__m128 v) { _mm_store_ps(e, v); }
+    __m128 m() const { return _mm_load_ps(e); }
+#endif
+
     inline float x() const { return e[0]; }
     inline float y() const { return e[1]; }
     inline float z() const { return e[2]; }
@@ -32,14 +34,8 @@ public:
     inline vec3 operator-() const {
         return vec3(-e[0], -e[1], -e[2]);
     }
-    inline float operator[](int i) const {
-        assert(0 <= i && i <= 2);
-        return e[i];
-    }
-    inline float& operator[](int i) {
-        assert(0 <= i && i <= 2);
-        return e[i];
-    }
+    inline float operator[](int i) const { return e[i]; }
+    inline float& operator[](int i) { return e[i]; }
     inline vec3& operator+=(const vec3& v2);
     inline vec3& operator-=(const vec3& v2);
     inline vec3& operator*=(const vec3& v2);
@@ -51,16 +47,13 @@ public:
         return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
     }
     inline float length() const {
-        return sqrt(norm());
+        return std::sqrt(norm());
     }
 
     inline void make_unit_vector(){
-        float k = 1.0 / length();
-        e[0] *= k;
-        e[1] *= k;
-        e[2] *= k;
+        *this /= length();
     }
-    float e[3];
+    float e[4];
 };
 
 inline std::istream& operator>>(std::istream& is, vec3& v)
@@ -77,35 +70,55 @@ inline std::ostream& operator<<(std::ostream& os, const vec3& v)
 
 inline vec3 operator+(const vec3& left, const vec3& right)
 {
+#ifdef VEC3_SSE
+    return vec3(_mm_add_ps(left.m(), right.m()));
+#else
     return vec3(left.e[0] + right.e[0],
                 left.e[1] + right.e[1],
                 left.e[2] + right.e[2]);
+#endif
 }
 
 inline vec3 operator-(const vec3& left, const vec3& right)
 {
+#ifdef VEC3_SSE
+    return vec3(_mm_sub_ps(left.m(), right.m()));
+#else
     return vec3(left.e[0] - right.e[0],
                 left.e[1] - right.e[1],
                 left.e[2] - right.e[2]);
+#endif
 }
 
 inline vec3 operator*(const vec3& left, const vec3& right)
 {
+#ifdef VEC3_SSE
+    return vec3(_mm_mul_ps(left.m(), right.m()));
+#else
     return vec3(left.e[0] * right.e[0],
                 left.e[1] * right.e[1],
                 left.e[2] * right.e[2]);
+#endif
 }
 
 inline vec3 operator/(const vec3& left, const vec3& right)
 {
+#ifdef VEC3_SSE
+    return vec3(_mm_div_ps(left.m(), right.m()));
+#else
     return vec3(left.e[0] / right.e[0],
                 left.e[1] / right.e[1],
                 left.e[2] / right.e[2]);
+#endif
 }
 
 inline vec3 operator*(float t, const vec3& v)
 {
+#ifdef VEC3_SSE
+    return vec3(_mm_mul_ps(_mm_set1_ps(t), v.m()));
+#else
     return vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
+#endif
 }
 
 inline vec3 operator*(const vec3& v, float t)
@@ -115,78 +128,116 @@ inline vec3 operator*(const vec3& v, float t)
 
 inline vec3 operator/(const vec3& v, float t)
 {
+#ifdef VEC3_SSE
+    return vec3(_mm_div_ps(v.m(), _mm_set1_ps(t)));
+#else
     return vec3(v.e[0] / t, v.e[1] / t, v.e[2] / t);
+#endif
 }
 
 inline float dot(const vec3& left, const vec3& right)
 {
+#ifdef VEC3_SSE
+    __m128 p = _mm_mul_ps(left.m(), right.m());
+    __m128 y = _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1));
+    __m128 z = _mm_shuffle_ps(p, p, _MM_SHUFFLE(2, 2, 2, 2));
+    return _mm_cvtss_f32(_mm_add_ss(_mm_add_ss(p, y), z));
+#else
     return left[0] * right[0] +
            left[1] * right[1] +
            left[2] * right[2];
+#endif
 }
 
 inline vec3 cross(const vec3& left, const vec3& right)
 {
+#ifdef VEC3_SSE
+    // (l.yzx * r.zxy) - (l.zxy * r.yzx)
+    __m128 l = left.m();
+    __m128 r = right.m();
+    __m128 l_yzx = _mm_shuffle_ps(l, l, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 r_yzx = _mm_shuffle_ps(r, r, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 c = _mm_sub_ps(_mm_mul_ps(l, r_yzx), _mm_mul_ps(l_yzx, r));
+    return vec3(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)));
+#else
     return vec3(
         left[1] * right[2] - left[2] * right[1],
         left[2] * right[0] - left[0] * right[2],
         left[0] * right[1] - left[1] * right[0]);
+#endif
+}
+
+// Componentwise minimum and maximum. Where a lane of left is NaN, the lane of
+// right is returned, like ffmin and ffmax.
+inline vec3 min(const vec3& left, const vec3& right)
+{
+#ifdef VEC3_SSE
+    return vec3(_mm_min_ps(left.m(), right.m()));
+#else
+    return vec3(left[0] < right[0] ? left[0] : right[0],
+                left[1] < right[1] ? left[1] : right[1],
+                left[2] < right[2] ? left[2] : right[2]);
+#endif
+}
+
+inline vec3 max(const vec3& left, const vec3& right)
+{
+#ifdef VEC3_SSE
+    return vec3(_mm_max_ps(left.m(), right.m()));
+#else
+    return vec3(left[0] > right[0] ? left[0] : right[0],
+                left[1] > right[1] ? left[1] : right[1],
+                left[2] > right[2] ? left[2] : right[2]);
+#endif
+}
+
+// Largest and smallest of the three components.
+inline float max_component(const vec3& v)
+{
+    float m = v[0] > v[1] ? v[0] : v[1];
+    return m > v[2] ? m : v[2];
+}
+
+inline float min_component(const vec3& v)
+{
+    float m = v[0] < v[1] ? v[0] : v[1];
+    return m < v[2] ? m : v[2];
 }
 
-// returns |a||b|sin(theta)
+// returns |a||b|sin(theta), only for vectors in the xy plane
 inline float cross_length_including_minus(const vec3& left, const vec3& right)
 {
-    // this function works only in 2 dimension.
-    assert(left[2] == 0 && right[2] == 0);
     return left[0] * right[1] - right[0] * left[1];
 }
 
 inline vec3& vec3::operator+=(const vec3& v)
 {
-    e[0] += v[0];
-    e[1] += v[1];
-    e[2] += v[2];
-    return *this;
+    return *this = *this + v;
 }
 
 inline vec3& vec3::operator-=(const vec3& v)
 {
-    e[0] -= v[0];
-    e[1] -= v[1];
-    e[2] -= v[2];
-    return *this;
+    return *this = *this - v;
 }
 
 inline vec3& vec3::operator*=(const vec3& v)
 {
-    e[0] *= v[0];
-    e[1] *= v[1];
-    e[2] *= v[2];
-    return *this;
+    return *this = *this * v;
 }
 
 inline vec3& vec3::operator/=(const vec3& v)
 {
-    e[0] /= v[0];
-    e[1] /= v[1];
-    e[2] /= v[2];
-    return *this;
+    return *this = *this / v;
 }
 
 inline vec3& vec3::operator*=(float t)
 {
-    e[0] *= t;
-    e[1] *= t;
-    e[2] *= t;
-    return *this;
+    return *this = *this * t;
 }
 
 inline vec3& vec3::operator/=(float t)
 {
-    e[0] /= t;
-    e[1] /= t;
-    e[2] /= t;
-    return *this;
+    return *this = *this / t;
 }
 
 inline vec3 unit_vector(vec3 v)
@@ -1,9 +1,13 @@
 #pragma once
 
+#include "grid.h"
 #include "material.h"
 #include "hitable.h"
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <limits>
 
 class constant_medium : public hitable {
 public:
@@ -13,42 +17,156 @@ public:
     bool bounding_box(float t0, float t1, aabb& box) const {
         return boundary->bounding_box(t0, t1, box);
     }
-    bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
-        bool db = rand_float() < 0.00001;
-        db = false; // debug setting
-        hit_record rec1, rec2;
-        // rec1.t = 最初にあたる場所
-        // rec2.t = 次にあたる場所
-        if (boundary->hit(r, std::numeric_limits<float>::lowest(), std::numeric_limits<float>::max(), rec1)) {
-            if (boundary->hit(r, rec1.t + 0.0001f, std::numeric_limits<float>::max(), rec2)) {
-                if (db)
-                    std::cerr << "t0 = " << rec1.t << " " << "t1 = " << rec2.t << std::endl;
-                rec1.t = std::max(rec1.t, t_min);
-                rec2.t = std::min(rec2.t, t_max);
-                if (rec1.t >= rec2.t)
-                    return false;
-
-                rec1.t = std::max(rec1.t, 0.0f);
-                float distance_inside_boundary = (rec2.t - rec1.t) * r.direction().length();
-                float hit_distance = -(1 / density) * log(rand_float());
-                if (hit_distance < distance_inside_boundary) {
-                    rec.t = rec1.t + hit_distance / r.direction().length();
-                    rec.p = r.point_at_parameter(rec.t);
-                    rec.normal = vec3(1, 0, 0); // arbitrary
-                    rec.mat_ptr = phase_function;
-                    if (db) {
-                        std::cerr << "hit_distance = " << hit_distance << std::endl;
-                        std::cerr << "rec.t = " << rec.t << std::endl;
-                        std::cerr << "rec.p = " << rec.p << std::endl;
-                    }
-                    return true;
-                }
-            }
+    bool hit(const ray& r, float t_min, float t_max, hit_info& hit) const {
+        float t0, t1;
+        if (!boundary->hit_interval(r, t_min, t_max, t0, t1))
+            return false;
+        t0 = std::max(t0, 0.0f);
+        float distance_inside_boundary = (t1 - t0) * r.direction().length();
+        float hit_distance = -(1 / density) * log(rand_float());
+        if (hit_distance < distance_inside_boundary) {
+            hit.t = t0 + hit_distance / r.direction().length();
+            hit.obj = this;
+            hit.wrappers = 0;
+            return true;
         }
         return false;
     }
+    void surface(const ray& r, const hit_info& hit, hit_record& rec) const {
+        rec.p = r.point_at_parameter(hit.t);
+        rec.normal = vec3(1, 0, 0); // arbitrary
+        rec.mat_ptr = phase_function;
+    }
     hitable* boundary;
     float density;
     material* phase_function;
 };
 
+// While a thread's current is set, its rays are shadow rays: grid_medium
+// lets them through and multiplies current by its transmittance along them,
+// instead of stopping them at a sampled collision. The estimate is then a
+// fraction rather than 0 or 1, which is far less noisy.
+struct shadow_transmittance {
+    static inline thread_local float* current = nullptr;
+};
+
+// Smoke or fog whose density varies in space, given by a brick_grid times
+// density_scale. Free paths are sampled by delta tracking against the
+// majorant of each brick the ray crosses, walking the bricks like a 3D DDA.
+// Empty bricks are stepped over without sampling, so the cost follows the
+// occupied volume rather than the size of the box.
+class grid_medium : public hitable {
+public:
+    grid_medium(const brick_grid* g, float scale, texture* a) : grid(g), density_scale(scale) {
+        phase_function = new isotropic(a);
+    }
+
+    bool bounding_box(float t0, float t1, aabb& box) const {
+        box = grid->occupied;
+        return true;
+    }
+
+    bool hit(const ray& r, float t_min, float t_max, hit_info& hit) const {
+        if (shadow_transmittance::current) {
+            *shadow_transmittance::current *= transmittance(r, t_min, t_max);
+            return false;
+        }
+        float speed = r.direction().length();
+        bool collided = false;
+        walk(r, t_min, t_max, [&](float t0, float t1, float majorant) {
+            // per unit of t
+            float sigma = majorant * density_scale * speed;
+            float t = t0;
+            while (true) {
+                t -= std::log(1 - rand_float()) / sigma;
+                if (t >= t1)
+                    return true;
+                // a real collision with probability density / majorant
+                if (rand_float() * majorant < grid->density(r.point_at_parameter(t))) {
+                    hit.t = t;
+                    hit.obj = this;
+                    hit.wrappers = 0;
+                    collided = true;
+                    return false;
+                }
+            }
+        });
+        return collided;
+    }
+
+    void surface(const ray& r, const hit_info& hit, hit_record& rec) const {
+        rec.p = r.point_at_parameter(hit.t);
+        rec.normal = vec3(1, 0, 0); // arbitrary
+        rec.mat_ptr = phase_function;
+    }
+
+    // Estimates the fraction of light passing through (t_min, t_max) of r by
+    // ratio tracking, for shadow rays, see shadow_transmittance.
+    float transmittance(const ray& r, float t_min, float t_max) const {
+        float speed = r.direction().length();
+        float result = 1;
+        walk(r, t_min, t_max, [&](float t0, float t1, float majorant) {
+            float sigma = majorant * density_scale * speed;
+            float t = t0;
+            while (true) {
+                t -= std::log(1 - rand_float()) / sigma;
+                if (t >= t1)
+                    return true;
+                result *= 1 - grid->density(r.point_at_parameter(t)) / majorant;
+                if (result <= 0)
+                    return false;
+            }
+        });
+        return std::max(result, 0.0f);
+    }
+
+    const brick_grid* grid;
+    float density_scale;
+    material* phase_function;
+
+private:
+    // Calls f(t0, t1, majorant) for the part of (t_min, t_max) in each
+    // brick along r with a nonzero majorant, front to back, until f returns
+    // false.
+    template <typename F>
+    void walk(const ray& r, float t_min, float t_max, F f) const {
+        const aabb& box = grid->box;
+        vec3 brick_extent = (box.max() - box.min()) / float(grid->bricks);
+        // empty bricks around the occupied ones are not even walked
+        float t_enter, t_exit;
+        if (!grid->occupied.hit(r, t_min, t_max, t_enter, t_exit))
+            return;
+
+        int cell[3], step[3], end[3];
+        float t_next[3], t_delta[3];
+        vec3 p = r.point_at_parameter(t_enter);
+        for (int a = 0; a < 3; a++) {
+            float d = r.direction()[a];
+            cell[a] = std::clamp(int((p[a] - box.min()[a]) / brick_extent[a]), 0, grid->bricks - 1);
+            step[a] = d > 0 ? 1 : -1;
+            end[a] = d > 0 ? grid->bricks : -1;
+            if (d == 0) {
+                t_next[a] = std::numeric_limits<float>::infinity();
+                t_delta[a] = std::numeric_limits<float>::infinity();
+            } else {
+                float boundary = box.min()[a] + (cell[a] + (d > 0)) * brick_extent[a];
+                t_next[a] = (boundary - r.origin()[a]) / d;
+                t_delta[a] = brick_extent[a] / std::fabs(d);
+            }
+        }
+
+        float t = t_enter;
+        while (t < t_exit) {
+            int a = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+            float t1 = std::min(t_next[a], t_exit);
+            float majorant = grid->majorant(cell[0], cell[1], cell[2]);
+            if (majorant > 0 && t1 > t && !f(t, t1, majorant))
+                return;
+            t = t1;
+            cell[a] += step[a];
+            if (cell[a] == end[a])
+                return;
+            t_next[a] += t_delta[a];
+        }
+    }
+};
@@ -0,0 +1,312 @@
+#pragma once
+
+#include "bvh.h"
+#include "environment.h"
+#include "hitable.h"
+#include "hitable_list.h"
+#include "material.h"
+#include "ray.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+// Wavefront path tracing. Instead of following one path to its end like
+// color(), a batch of paths advances one bounce at a time: all of them are
+// intersected, the hits are binned by material kind, and every bin is shaded
+// by a loop calling that material directly. Hits of one material then run
+// the same code back to back instead of jumping between virtual functions.
+
+struct wavefront_path {
+    ray r;
+    vec3 throughput { 1, 1, 1 };
+    // index of the sum in trace_wavefront this path adds to
+    int pixel = 0;
+    int depth = 0;
+    bool alive = true;
+    hit_info hit;
+};
+
+const int wavefront_max_depth = 50;
+
+// Adds the emission at the hit of each path in queue and scatters it, or
+// ends it. recs[i] is the finished hit of paths[i]. Same as one level of
+// color().
+template <typename M>
+void shade_queue(const std::vector<int>& queue, std::vector<wavefront_path>& paths, const std::vector<hit_record>& recs, std::vector<vec3>& sums)
+{
+    for (int i : queue) {
+        wavefront_path& path = paths[i];
+        const hit_record& rec = recs[i];
+        const M* mat = static_cast<const M*>(rec.mat_ptr);
+        ray scattered;
+        vec3 attenuation;
+        bool scatters;
+        if constexpr (std::is_same_v<M, material>) {
+            sums[path.pixel] += path.throughput * mat->emitted(rec.u, rec.v, rec.p);
+            scatters = path.depth < wavefront_max_depth && mat->scatter(path.r, rec, attenuation, scattered);
+        } else {
+            // qualified calls, no virtual dispatch
+            sums[path.pixel] += path.throughput * mat->M::emitted(rec.u, rec.v, rec.p);
+            scatters = path.depth < wavefront_max_depth && mat->M::scatter(path.r, rec, attenuation, scattered);
+        }
+        if (scatters) {
+            scattered.cone_width = path.r.footprint(rec.t);
+            scattered.cone_spread = path.r.cone_spread;
+            path.r = scattered;
+            path.throughput *= attenuation;
+            path.depth++;
+        } else {
+            path.alive = false;
+        }
+    }
+}
+
+// Intersects paths in groups of coherent rays. The paths are sorted by
+// direction octant and then by origin along a Morton curve, and each group
+// walks the BVH once: a node tests its box against all rays of the group
+// still active and passes only those that hit it on to its children, the
+// nearer one along the group's direction first. Rays of one group share
+// every node fetch, instead of each ray loading the nodes on its own, and
+// keep their origins, inverse directions and tmax in arrays of their own.
+// The world is split once per call into its bvh_nodes, lists included, and
+// the other objects, which are traced ray by ray.
+class ray_stream {
+public:
+    explicit ray_stream(int size = 1024) : group_size(size) { }
+
+    // Sorts paths and sets hit[i] for paths[i] after sorting, with the hit
+    // in paths[i].hit.
+    void intersect(std::vector<wavefront_path>& paths, const hitable* world, std::vector<char>& hit) {
+        sort(paths, world);
+        roots.clear();
+        others.clear();
+        split(world);
+        int n = paths.size();
+        hit.assign(n, 0);
+        for (int first = 0; first < n; first += group_size) {
+            int count = std::min(group_size, n - first);
+            load(paths, first, count);
+            for (const bvh_node* root : roots)
+                traverse(root, 0, count, paths, hit);
+            for (const hitable* h : others)
+                hit_each(h, 0, count, paths, hit);
+        }
+    }
+
+    // (ray, node) box tests, the work done by single-ray traversal too
+    int64_t box_tests = 0;
+    // node visits by a group, each loading the node once
+    int64_t node_fetches = 0;
+
+private:
+    static uint32_t spread_bits(uint32_t v) {
+        v = (v | v << 16) & 0x030000ff;
+        v = (v | v << 8) & 0x0300f00f;
+        v = (v | v << 4) & 0x030c30c3;
+        v = (v | v << 2) & 0x09249249;
+        return v;
+    }
+
+    void sort(std::vector<wavefront_path>& paths, const hitable* world) {
+        aabb box;
+        if (!world->bounding_box(0, 1, box))
+            return;
+        int n = paths.size();
+        std::vector<std::pair<uint64_t, int>> keys(n);
+        for (int i = 0; i < n; i++) {
+            const ray& r = paths[i].r;
+            uint32_t cell[3];
+            for (int a = 0; a < 3; a++) {
+                float extent = box.max()[a] - box.min()[a];
+                float f = extent > 0 ? (r.origin()[a] - box.min()[a]) / extent : 0;
+                cell[a] = std::clamp(int(f * 1024), 0, 1023);
+            }
+            uint64_t octant = (r.direction().x() < 0) | (r.direction().y() < 0) << 1 | (r.direction().z() < 0) << 2;
+            uint64_t morton = spread_bits(cell[0]) | spread_bits(cell[1]) << 1 | spread_bits(cell[2]) << 2;
+            keys[i] = { octant << 30 | morton, i };
+        }
+        std::sort(keys.begin(), keys.end());
+        std::vector<wavefront_path> sorted(n);
+        for (int i = 0; i < n; i++)
+            sorted[i] = paths[keys[i].second];
+        paths.swap(sorted);
+    }
+
+    void split(const hitable* h) {
+        if (const bvh_node* node = dynamic_cast<const bvh_node*>(h))
+            roots.push_back(node);
+        else if (const hitable_list* list = dynamic_cast<const hitable_list*>(h)) {
+            for (int i = 0; i < list->list_size; i++)
+                split(list->list[i]);
+        } else
+            others.push_back(h);
+    }
+
+    // Makes paths[first, first + count) the group, all of it active.
+    void load(const std::vector<wavefront_path>& paths, int first, int count) {
+        base = first;
+        origins.resize(count);
+        inverses.resize(count);
+        tmax.assign(count, 1e9);
+        active.resize(std::max<int>(active.size(), count));
+        top = count;
+        direction = vec3(0, 0, 0);
+        for (int j = 0; j < count; j++) {
+            const ray& r = paths[first + j].r;
+            origins[j] = r.origin();
+            inverses[j] = vec3(1, 1, 1) / r.direction();
+            direction += unit_vector(r.direction());
+            active[j] = j;
+        }
+    }
+
+    // Slab test like aabb::hit, by the inverse direction. The exit is
+    // widened by a few ulps, so rounding never drops a box the division
+    // would keep; the primitives decide the hits.
+    bool box_hit(const aabb& b, int j) const {
+#ifdef VEC3_SSE
+        // tmax is broadcast in a register; building a vec3 of it goes
+        // through memory and stalls every test on store forwarding
+        __m128 o = origins[j].m();
+        __m128 inverse = inverses[j].m();
+        __m128 ta = _mm_mul_ps(_mm_sub_ps(b.min().m(), o), inverse);
+        __m128 tb = _mm_mul_ps(_mm_sub_ps(b.max().m(), o), inverse);
+        __m128 lo = _mm_max_ps(_mm_min_ps(ta, tb), _mm_set1_ps(0.001f));
+        __m128 hi = _mm_min_ps(_mm_max_ps(ta, tb), _mm_set1_ps(tmax[j]));
+        lo = _mm_max_ss(_mm_max_ss(lo, _mm_shuffle_ps(lo, lo, _MM_SHUFFLE(1, 1, 1, 1))),
+                        _mm_shuffle_ps(lo, lo, _MM_SHUFFLE(2, 2, 2, 2)));
+        hi = _mm_min_ss(_mm_min_ss(hi, _mm_shuffle_ps(hi, hi, _MM_SHUFFLE(1, 1, 1, 1))),
+                        _mm_shuffle_ps(hi, hi, _MM_SHUFFLE(2, 2, 2, 2)));
+        return _mm_cvtss_f32(lo) <= _mm_cvtss_f32(hi) * 1.0000004f;
+#else
+        vec3 ta = (b.min() - origins[j]) * inverses[j];
+        vec3 tb = (b.max() - origins[j]) * inverses[j];
+        float t_enter = max_component(max(min(ta, tb), vec3(0.001f, 0.001f, 0.001f)));
+        float t_exit = min_component(min(max(ta, tb), vec3(tmax[j], tmax[j], tmax[j])));
+        return t_enter <= t_exit * 1.0000004f;
+#endif
+    }
+
+    // The rays entering node are active[first, first + count). Survivors are
+    // written behind them at top for the children and dropped on return.
+    void traverse(const bvh_node* node, int first, int count, std::vector<wavefront_path>& paths, std::vector<char>& hit) {
+        node_fetches++;
+        box_tests += count;
+        int begin = top;
+        if (int(active.size()) < begin + count)
+            active.resize(2 * (begin + count));
+        // every ray is written, only survivors advance the end, no branch
+        int* a = active.data();
+        int end = begin;
+        for (int k = first; k < first + count; k++) {
+            int j = a[k];
+            a[end] = j;
+            end += box_hit(node->box, j);
+        }
+        top = end;
+        int survivors = end - begin;
+        if (survivors > 0 && node->leaf) {
+            visit_leaf(node->left, node->left_nested, begin, survivors, paths, hit);
+            if (node->right != node->left)
+                visit_leaf(node->right, node->right_nested, begin, survivors, paths, hit);
+        } else if (survivors > 0) {
+            const bvh_node* near = static_cast<const bvh_node*>(node->left);
+            const bvh_node* far = static_cast<const bvh_node*>(node->right);
+            if (dot(near->box.min() + near->box.max() - far->box.min() - far->box.max(), direction) > 0)
+                std::swap(near, far);
+            traverse(near, begin, survivors, paths, hit);
+            traverse(far, begin, survivors, paths, hit);
+        }
+        top = begin;
+    }
+
+    void visit_leaf(const hitable* child, bool nested, int first, int count, std::vector<wavefront_path>& paths, std::vector<char>& hit) {
+        if (nested)
+            traverse(static_cast<const bvh_node*>(child), first, count, paths, hit);
+        else
+            hit_each(child, first, count, paths, hit);
+    }
+
+    // Traces rays active[first, first + count) against h one by one.
+    void hit_each(const hitable* h, int first, int count, std::vector<wavefront_path>& paths, std::vector<char>& hit) {
+        for (int k = first; k < first + count; k++) {
+            int j = active[k];
+            wavefront_path& path = paths[base + j];
+            if (h->hit(path.r, 0.001, tmax[j], path.hit)) {
+                hit[base + j] = 1;
+                tmax[j] = path.hit.t;
+            }
+        }
+    }
+
+    int group_size;
+    // the world's bvh_nodes and its other objects, see split()
+    std::vector<const bvh_node*> roots;
+    std::vector<const hitable*> others;
+    // the group: paths[base, base + size), by index j into the arrays below
+    int base = 0;
+    std::vector<vec3> origins;
+    std::vector<vec3> inverses;
+    std::vector<float> tmax;
+    // sum of the group's unit directions, to order children by
+    vec3 direction;
+    // the rays still active at each level of the traversal, the current
+    // one ending at top
+    std::vector<int> active;
+    int top = 0;
+};
+
+// Traces all paths to the end, adding what they collect to sums[pixel].
+// With stream, each bounce is intersected through ray_stream. Paths leaving
+// the scene add sky if given.
+void trace_wavefront(std::vector<wavefront_path>& paths, hitable* world, std::vector<vec3>& sums, bool stream = false, const environment* sky = nullptr)
+{
+    const int kinds = int(material_kind::custom) + 1;
+    std::vector<int> queues[kinds];
+    ray_stream streamer;
+    std::vector<char> hit;
+    std::vector<hit_record> recs;
+    while (!paths.empty()) {
+        for (auto& q : queues)
+            q.clear();
+
+        // intersect every path, bin the hits
+        if (stream) {
+            streamer.intersect(paths, world, hit);
+        } else {
+            hit.resize(paths.size());
+            for (int i = 0; i < int(paths.size()); i++)
+                hit[i] = world->hit(paths[i].r, 0.001, 1e9, paths[i].hit);
+        }
+        recs.resize(paths.size());
+        for (int i = 0; i < int(paths.size()); i++) {
+            wavefront_path& path = paths[i];
+            if (hit[i]) {
+                finish_hit(path.r, path.hit, recs[i]);
+                queues[int(recs[i].mat_ptr->kind)].push_back(i);
+            } else {
+                if (sky)
+                    sums[path.pixel] += path.throughput * sky->radiance(path.r.direction());
+                path.alive = false;
+            }
+        }
+
+        shade_queue<material>(queues[int(material_kind::generic)], paths, recs, sums);
+        shade_queue<lambertian>(queues[int(material_kind::lambertian)], paths, recs, sums);
+        shade_queue<metal>(queues[int(material_kind::metal)], paths, recs, sums);
+        shade_queue<dielectric>(queues[int(material_kind::dielectric)], paths, recs, sums);
+        shade_queue<diffuse_light>(queues[int(material_kind::diffuse_light)], paths, recs, sums);
+        shade_queue<isotropic>(queues[int(material_kind::isotropic)], paths, recs, sums);
+        shade_queue<custom_material>(queues[int(material_kind::custom)], paths, recs, sums);
+
+        // drop finished paths
+        int alive = 0;
+        for (int i = 0; i < int(paths.size()); i++) {
+            if (paths[i].alive)
+                paths[alive++] = paths[i];
+        }
+        paths.resize(alive);
+    }
+}